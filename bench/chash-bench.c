@@ -0,0 +1,185 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Scaling of cod_chash_map against cod_hash_map behind a global mutex.
+ *
+ * Build and run:
+ *   gcc -O2 -pthread -Iinclude bench/chash-bench.c src/chash-map.c \
+ *       src/hash-map.c src/hash64.c -o chash-bench
+ *   ./chash-bench [maxthreads] [write%]
+ *
+ * Every thread runs NOPS operations on random keys from a prefilled set of
+ * NKEYS integer keys: lookups, and with probability `write%` (default 10) an
+ * insertion or erasure. Thread counts are doubled from 1 to `maxthreads`
+ * (default 64); figures are total throughput in millions of operations per
+ * second, so flat rows mean no scaling.
+ */
+#include "codeine/chash-map.h"
+#include "codeine/hash-map.h"
+#include "codeine/hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifndef NOPS
+# define NOPS 1000000
+#endif
+#define NKEYS (1 << 20)
+#define NSHARDS 64
+
+static cod_hash_map *locked_map;
+static pthread_mutex_t locked_mutex = PTHREAD_MUTEX_INITIALIZER;
+static cod_chash_map *chash_map;
+
+static int write_pct = 10;
+static pthread_barrier_t start;
+
+static inline uint64_t
+rng(uint64_t *state)
+{
+  *state += 0x9e3779b97f4a7c15ull;
+  return cod_fmix64(*state);
+}
+
+/* Keys are 1..NKEYS (integer keys can't be NULL). */
+static inline char*
+key_of(uint64_t x)
+{ return (char*)(uintptr_t)(x % NKEYS + 1); }
+
+static inline uint32_t
+hash_of(const char *key)
+{ return cod_fmix64((uintptr_t)key); }
+
+static void*
+locked_thread(void *arg)
+{
+  uint64_t state = (uintptr_t)arg;
+  size_t found = 0;
+  pthread_barrier_wait(&start);
+  for (int i = 0; i < NOPS; ++i)
+  {
+    uint64_t x = rng(&state);
+    char *key = key_of(x >> 8);
+    uint32_t hash = hash_of(key);
+    pthread_mutex_lock(&locked_mutex);
+    if ((int)(x % 100) >= write_pct)
+      found += cod_hash_map_find(locked_map, key, hash) != NULL;
+    else if (x & 0x80)
+      cod_hash_map_insert(locked_map, key, hash, key, NULL);
+    else
+      cod_hash_map_erase(locked_map, key, hash, NULL);
+    pthread_mutex_unlock(&locked_mutex);
+  }
+  return (void*)found;
+}
+
+static void*
+chash_thread(void *arg)
+{
+  uint64_t state = (uintptr_t)arg;
+  size_t found = 0;
+  cod_chash_reader *reader = cod_chash_map_reader(chash_map);
+  if (reader == NULL)
+    abort();
+  pthread_barrier_wait(&start);
+  for (int i = 0; i < NOPS; ++i)
+  {
+    uint64_t x = rng(&state);
+    char *key = key_of(x >> 8);
+    uint32_t hash = hash_of(key);
+    if ((int)(x % 100) >= write_pct)
+    {
+      void *val;
+      cod_chash_map_enter(chash_map, reader);
+      found += cod_chash_map_find(chash_map, key, hash, &val);
+      cod_chash_map_leave(chash_map, reader);
+    }
+    else if (x & 0x80)
+    {
+      cod_chash_map_insert(chash_map, key, hash, key, NULL);
+    }
+    else
+    {
+      cod_chash_map_erase(chash_map, key, hash, NULL);
+    }
+  }
+  cod_chash_map_release_reader(chash_map, reader);
+  return (void*)found;
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Run `nthreads` threads and return throughput in Mops/s. */
+static double
+run(void* (*fn)(void*), int nthreads)
+{
+  pthread_t th[nthreads];
+  pthread_barrier_init(&start, NULL, nthreads + 1);
+  for (int i = 0; i < nthreads; ++i)
+    pthread_create(&th[i], NULL, fn, (void*)(uintptr_t)(i + 1));
+  pthread_barrier_wait(&start);
+  double t0 = now();
+  for (int i = 0; i < nthreads; ++i)
+    pthread_join(th[i], NULL);
+  double t = now() - t0;
+  pthread_barrier_destroy(&start);
+  return (double)nthreads * NOPS / t * 1e-6;
+}
+
+int
+main(int argc, char **argv)
+{
+  const int maxthreads = argc > 1 ? atoi(argv[1]) : 64;
+  if (argc > 2)
+    write_pct = atoi(argv[2]);
+  if (maxthreads <= 0 || maxthreads > COD_CHASH_MAP_MAX_READERS ||
+      write_pct < 0 || write_pct > 100)
+  {
+    fprintf(stderr, "usage: %s [maxthreads] [write%%]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  locked_map = cod_hash_map_new_with_capacity(COD_HASH_MAP_INTKEYS, NKEYS);
+  chash_map = cod_chash_map_new(COD_HASH_MAP_INTKEYS, NSHARDS);
+  /* Half of the keys are present. */
+  for (uint64_t k = 0; k < NKEYS; k += 2)
+  {
+    char *key = key_of(k);
+    cod_hash_map_insert(locked_map, key, hash_of(key), key, NULL);
+    cod_chash_map_insert(chash_map, key, hash_of(key), key, NULL);
+  }
+
+  printf("Mops/s, %d%% writes, %d keys\n", write_pct, NKEYS);
+  printf("%8s %14s %14s\n", "threads", "mutex+map", "chash-map");
+  for (int n = 1; n <= maxthreads; n *= 2)
+  {
+    double tl = run(locked_thread, n);
+    double tc = run(chash_thread, n);
+    printf("%8d %14.2f %14.2f\n", n, tl, tc);
+  }
+
+  cod_hash_map_delete(locked_map, NULL);
+  cod_chash_map_delete(chash_map, NULL);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,594 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Throughput and distribution quality of the hash functions.
+ *
+ * Build and run:
+ *   gcc -O2 -Iinclude bench/hash-bench.c src/hash-map.c src/hash64.c \
+ *       src/siphash.c -o hash-bench -lm
+ *   ./hash-bench [speed] [quality] [batch] [build] [churn]
+ *
+ * Without arguments only speed and quality are run.
+ *
+ * Speed: each hash is computed in a chain (the previous hash is mixed into
+ * the next key), so the figures are latencies rather than pipelined
+ * throughput. Cycles are read with RDTSC where available, otherwise
+ * nanoseconds are reported.
+ *
+ * Quality: keys are placed into `cap` buckets by `hash & (cap - 1)`, the way
+ * cod_hash_map looks them up.
+ *  - chi2: z-score of the chi-square statistic of bucket counts against the
+ *    uniform distribution; |z| of a few units is noise, tens and above mean
+ *    clustering.
+ *  - maxb: length of the longest bucket.
+ *  - aval: worst deviation (in percent) from 50% of the probability that an
+ *    output bit flips when a single input bit is flipped, over the low 32 bits.
+ *    With 2000 samples per bit, values up to about 5% are sampling noise.
+ *
+ * Maps (cod_hash_map with MAP_KEYS random string keys, default 4M, so that
+ * the table is well beyond the LLC):
+ *  - batch: ns per lookup of existing keys in random order, by find() in a
+ *    loop and by find_batch().
+ *  - build: ns per element to load all keys by inserting them one by one (into
+ *    a default-sized and a presized map) and by cod_hash_map_build().
+ *  - churn: CHURN_ROUNDS rounds of inserting MAP_KEYS / 2 integer keys and
+ *    erasing 99% of them; memory held by the table at the end (without and
+ *    with COD_HASH_MAP_AUTOSHRINK, and after cod_hash_map_shrink_to_fit()),
+ *    and time of the churn. Also ns per insert+erase pair when every key is
+ *    erased right after insertion (the map never holds more than one key, so
+ *    its table must stay at the minimal size).
+ */
+#include "codeine/hash.h"
+#include "codeine/hash-map.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define UNIT "cycles"
+static inline uint64_t now(void) { return __rdtsc(); }
+#else
+# define UNIT "ns"
+static inline uint64_t
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+/* Keys are NUL-free strings, so that the string hashes see the same bytes. */
+typedef uint64_t (*hash_fn)(const char *s, size_t len);
+
+static const uint8_t sipkey[16] = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+
+static uint64_t
+h_djb2(const char *s, size_t len)
+{ (void)len; return cod_djb2(s); }
+
+static uint64_t
+h_sdbm(const char *s, size_t len)
+{ (void)len; return cod_sdbm(s); }
+
+static uint64_t
+h_halfsiphash(const char *s, size_t len)
+{ return cod_halfsiphash(sipkey, (const uint8_t*)s, len); }
+
+static uint64_t
+h_hash64(const char *s, size_t len)
+{ return cod_hash64(s, len, 0); }
+
+static const struct {
+  const char *name;
+  hash_fn fn;
+} hashes[] = {
+  { "djb2", h_djb2 },
+  { "sdbm", h_sdbm },
+  { "halfsiphash", h_halfsiphash },
+  { "hash64", h_hash64 },
+};
+#define NHASHES (sizeof hashes / sizeof hashes[0])
+
+static uint64_t rng_state = 0x243f6a8885a308d3ull;
+
+static uint64_t
+rng(void)
+{
+  rng_state += 0x9e3779b97f4a7c15ull;
+  return cod_fmix64(rng_state);
+}
+
+static void
+random_bytes(char *s, size_t len)
+{
+  for (size_t i = 0; i < len; ++i)
+    s[i] = 1 + rng() % 255;
+  s[len] = 0;
+}
+
+/******************************************************************************
+ * Speed
+ */
+static void
+bench_speed(void)
+{
+  static const size_t lens[] = {
+    1, 2, 4, 8, 12, 16, 24, 32, 48, 64, 96, 128, 256, 512, 1024, 4096,
+  };
+  const size_t nlens = sizeof lens / sizeof lens[0];
+  char *buf = malloc(4097);
+  random_bytes(buf, 4096);
+
+  printf("%s/hash (%s/byte)\n", UNIT, UNIT);
+  printf("%6s", "len");
+  for (size_t h = 0; h < NHASHES; ++h)
+    printf(" %20s", hashes[h].name);
+  printf("\n");
+
+  for (size_t l = 0; l < nlens; ++l)
+  {
+    const size_t len = lens[l];
+    const size_t iters = len < 64 ? 1000000 : 64000000 / len;
+    char save = buf[len];
+    buf[len] = 0;
+    printf("%6zu", len);
+    for (size_t h = 0; h < NHASHES; ++h)
+    {
+      hash_fn fn = hashes[h].fn;
+      uint64_t x = 0;
+      /* Warm up. */
+      for (size_t i = 0; i < iters / 16; ++i)
+        x += fn(buf, len);
+      uint64_t t0 = now();
+      for (size_t i = 0; i < iters; ++i)
+      {
+        buf[0] = (char)(x | 1);
+        x = fn(buf, len);
+      }
+      double per_hash = (double)(now() - t0) / iters;
+      char cell[32];
+      snprintf(cell, sizeof cell, "%.1f (%.2f)", per_hash, per_hash / len);
+      printf(" %20s", cell);
+      __asm__ volatile ("" :: "r"(x));
+    }
+    printf("\n");
+    buf[len] = save;
+  }
+  printf("\n");
+  free(buf);
+}
+
+/******************************************************************************
+ * Quality
+ */
+typedef struct {
+  const char *name;
+  /* Write i-th key into `s` (at least 64 bytes); return its length. */
+  size_t (*make)(char *s, size_t i);
+} keyset;
+
+static size_t
+ks_random(char *s, size_t i)
+{
+  (void)i;
+  size_t len = 4 + rng() % 28;
+  random_bytes(s, len);
+  return len;
+}
+
+static size_t
+ks_seqint(char *s, size_t i)
+{ return sprintf(s, "%zu", i); }
+
+static size_t
+ks_prefix(char *s, size_t i)
+{ return sprintf(s, "/usr/share/codeine/resources/item-%zu", i); }
+
+static size_t
+ks_stride(char *s, size_t i)
+{ return sprintf(s, "%zu", i * 1024); }
+
+static const keyset keysets[] = {
+  { "random", ks_random },
+  { "seq-int", ks_seqint },
+  { "prefix", ks_prefix },
+  { "stride", ks_stride },
+};
+#define NKEYSETS (sizeof keysets / sizeof keysets[0])
+
+static void
+distribution(hash_fn fn, const keyset *ks, size_t cap, double *z,
+    size_t *maxb)
+{
+  /* As many keys as buckets: the load at which cod_hash_map grows. */
+  const size_t n = cap;
+  size_t *cnt = calloc(cap, sizeof(size_t));
+  char s[64];
+  for (size_t i = 0; i < n; ++i)
+  {
+    size_t len = ks->make(s, i);
+    cnt[fn(s, len) & (cap - 1)] += 1;
+  }
+
+  const double expect = (double)n / cap;
+  double chi2 = 0;
+  *maxb = 0;
+  for (size_t b = 0; b < cap; ++b)
+  {
+    double d = cnt[b] - expect;
+    chi2 += d * d / expect;
+    if (cnt[b] > *maxb)
+      *maxb = cnt[b];
+  }
+  *z = (chi2 - (cap - 1)) / sqrt(2.0 * (cap - 1));
+  free(cnt);
+}
+
+static double
+avalanche(hash_fn fn, size_t len)
+{
+  enum { NSAMPLES = 2000 };
+  const size_t nbits = len * 8;
+  unsigned *flips = calloc(nbits * 32, sizeof(unsigned));
+  unsigned *trials = calloc(nbits, sizeof(unsigned));
+  char s[64];
+
+  for (int k = 0; k < NSAMPLES; ++k)
+  {
+    random_bytes(s, len);
+    uint32_t h0 = fn(s, len);
+    for (size_t ib = 0; ib < nbits; ++ib)
+    {
+      char c = s[ib / 8];
+      s[ib / 8] ^= 1 << (ib % 8);
+      if (s[ib / 8] != 0)
+      {
+        uint32_t d = h0 ^ (uint32_t)fn(s, len);
+        trials[ib] += 1;
+        for (int ob = 0; ob < 32; ++ob)
+          flips[ib * 32 + ob] += (d >> ob) & 1;
+      }
+      s[ib / 8] = c;
+    }
+  }
+
+  double worst = 0;
+  for (size_t ib = 0; ib < nbits; ++ib)
+  {
+    for (int ob = 0; ob < 32; ++ob)
+    {
+      double p = (double)flips[ib * 32 + ob] / trials[ib];
+      if (fabs(p - 0.5) > worst)
+        worst = fabs(p - 0.5);
+    }
+  }
+  free(flips);
+  free(trials);
+  return worst * 100;
+}
+
+static void
+bench_quality(void)
+{
+  static const size_t caps[] = { 1 << 8, 1 << 12, 1 << 16 };
+  const size_t ncaps = sizeof caps / sizeof caps[0];
+
+  printf("bucket distribution: chi2 z-score / longest bucket\n");
+  printf("%-12s %-8s", "hash", "keys");
+  for (size_t c = 0; c < ncaps; ++c)
+    printf(" %14zu", caps[c]);
+  printf("\n");
+  for (size_t h = 0; h < NHASHES; ++h)
+  {
+    for (size_t k = 0; k < NKEYSETS; ++k)
+    {
+      printf("%-12s %-8s", hashes[h].name, keysets[k].name);
+      for (size_t c = 0; c < ncaps; ++c)
+      {
+        double z;
+        size_t maxb;
+        distribution(hashes[h].fn, &keysets[k], caps[c], &z, &maxb);
+        char cell[32];
+        snprintf(cell, sizeof cell, "%.1f / %zu", z, maxb);
+        printf(" %14s", cell);
+      }
+      printf("\n");
+    }
+  }
+  printf("\n");
+
+  static const size_t lens[] = { 4, 8, 16, 32 };
+  const size_t nlens = sizeof lens / sizeof lens[0];
+  printf("avalanche: worst bias, %%\n");
+  printf("%-12s", "hash");
+  for (size_t l = 0; l < nlens; ++l)
+    printf(" %8zu", lens[l]);
+  printf("\n");
+  for (size_t h = 0; h < NHASHES; ++h)
+  {
+    printf("%-12s", hashes[h].name);
+    for (size_t l = 0; l < nlens; ++l)
+      printf(" %8.1f", avalanche(hashes[h].fn, lens[l]));
+    printf("\n");
+  }
+}
+
+/******************************************************************************
+ * Maps
+ */
+#ifndef MAP_KEYS
+# define MAP_KEYS (1 << 22)
+#endif
+
+static const struct {
+  const char *name;
+  int flags;
+} engines[] = {
+  { "chain", 0 },
+  { "flat", COD_HASH_MAP_FLAT },
+  { "ordered", COD_HASH_MAP_ORDERED },
+};
+#define NENGINES (sizeof engines / sizeof engines[0])
+
+static double
+seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Unique string keys (index followed by random letters) and their hashes, in
+ * a single allocation; free with free(keys). */
+static char**
+make_keys(size_t n, uint32_t **hashes)
+{
+  enum { KEYSIZE = 24 };
+  char **keys = malloc((sizeof(char*) + KEYSIZE) * n);
+  char *blob = (char*)(keys + n);
+  *hashes = malloc(sizeof(uint32_t) * n);
+  for (size_t i = 0; i < n; ++i)
+  {
+    keys[i] = blob + i * KEYSIZE;
+    int len = sprintf(keys[i], "%zx-", i);
+    for (; len < KEYSIZE - 8; ++len)
+      keys[i][len] = 'a' + rng() % 26;
+    keys[i][len] = 0;
+    (*hashes)[i] = cod_hash_map_hash_n(keys[i], len);
+  }
+  return keys;
+}
+
+static void
+bench_batch(void)
+{
+  const size_t n = MAP_KEYS;
+  uint32_t *hashes;
+  char **keys = make_keys(n, &hashes);
+
+  /* Existing keys in random order. */
+  const char **qkeys = malloc(sizeof(char*) * n);
+  uint32_t *qhashes = malloc(sizeof(uint32_t) * n);
+  cod_hash_map_elt **out = malloc(sizeof(void*) * n);
+  for (size_t i = 0; i < n; ++i)
+  {
+    size_t j = rng() % n;
+    qkeys[i] = keys[j];
+    qhashes[i] = hashes[j];
+  }
+
+  printf("ns/lookup, %zu keys\n", n);
+  printf("%-8s %10s %12s\n", "engine", "find", "find_batch");
+  for (size_t e = 0; e < NENGINES; ++e)
+  {
+    cod_hash_map *map = cod_hash_map_new(engines[e].flags);
+    for (size_t i = 0; i < n; ++i)
+      cod_hash_map_insert(map, keys[i], hashes[i], NULL, NULL);
+
+    double t0 = seconds();
+    for (size_t i = 0; i < n; ++i)
+      out[i] = cod_hash_map_find(map, qkeys[i], qhashes[i]);
+    double t1 = seconds();
+    cod_hash_map_find_batch(map, qkeys, qhashes, n, out);
+    double t2 = seconds();
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (out[i] == NULL || strcmp(out[i]->key, qkeys[i]) != 0)
+        abort();
+    }
+    printf("%-8s %10.1f %12.1f\n", engines[e].name, (t1 - t0) / n * 1e9,
+        (t2 - t1) / n * 1e9);
+    cod_hash_map_delete(map, NULL);
+  }
+  printf("\n");
+
+  free(out);
+  free(qhashes);
+  free(qkeys);
+  free(hashes);
+  free(keys);
+}
+
+static void
+bench_build(void)
+{
+  const size_t n = MAP_KEYS;
+  uint32_t *hashes;
+  char **keys = make_keys(n, &hashes);
+
+  printf("ns/element, %zu keys\n", n);
+  printf("%-8s %10s %10s %10s %10s\n", "engine", "insert", "presized",
+      "build", "partition");
+  for (size_t e = 0; e < NENGINES; ++e)
+  {
+    const int flags = engines[e].flags;
+    double t[4];
+    for (int k = 0; k < 4; ++k)
+    {
+      double t0 = seconds();
+      cod_hash_map *map;
+      if (k < 2)
+      {
+        map = k ? cod_hash_map_new_with_capacity(flags, n)
+                : cod_hash_map_new(flags);
+        for (size_t i = 0; i < n; ++i)
+          cod_hash_map_insert(map, keys[i], hashes[i], NULL, NULL);
+      }
+      else
+      {
+        int f = k == 3 ? flags | COD_HASH_MAP_PARTITION : flags;
+        map = cod_hash_map_build(f, (const char**)keys, hashes, NULL, n);
+      }
+      t[k] = (seconds() - t0) / n * 1e9;
+      if (map->size != n)
+        abort();
+      cod_hash_map_delete(map, NULL);
+    }
+    printf("%-8s %10.1f %10.1f %10.1f %10.1f\n", engines[e].name, t[0], t[1],
+        t[2], t[3]);
+  }
+  printf("\n");
+
+  free(hashes);
+  free(keys);
+}
+
+#ifndef CHURN_ROUNDS
+# define CHURN_ROUNDS 4
+#endif
+
+static double
+table_mb(const cod_hash_map *map)
+{
+  cod_hash_map_stat stat;
+  cod_hash_map_stats(map, &stat);
+  return (stat.table_bytes + stat.key_bytes) / 1e6;
+}
+
+static void
+bench_churn(void)
+{
+  const size_t n = MAP_KEYS / 2;
+
+  printf("churn: insert and erase %zu integer keys one at a time\n", n);
+  printf("%-8s %10s\n", "engine", "ns/pair");
+  for (size_t e = 0; e < NENGINES; ++e)
+  {
+    cod_hash_map *map =
+      cod_hash_map_new(engines[e].flags | COD_HASH_MAP_INTKEYS);
+    double t0 = seconds();
+    for (size_t i = 1; i <= n; ++i)
+    {
+      cod_hash_map_insert(map, (char*)(uintptr_t)i, cod_fmix64(i), NULL, NULL);
+      cod_hash_map_erase(map, (char*)(uintptr_t)i, cod_fmix64(i), NULL);
+    }
+    double t = seconds() - t0;
+    if (map->size != 0 || map->cap > 64)
+      abort();
+    printf("%-8s %10.1f\n", engines[e].name, t / n * 1e9);
+    cod_hash_map_delete(map, NULL);
+  }
+  printf("\n");
+
+  printf("churn: %d x (insert %zu integer keys, erase 99%%)\n", CHURN_ROUNDS,
+      n);
+  printf("%-8s %-10s %10s %10s %10s\n", "engine", "flags", "MB", "fit MB",
+      "time, s");
+  for (size_t e = 0; e < NENGINES; ++e)
+  {
+    for (int shrink = 0; shrink < 2; ++shrink)
+    {
+      int flags = engines[e].flags | COD_HASH_MAP_INTKEYS;
+      if (shrink)
+        flags |= COD_HASH_MAP_AUTOSHRINK;
+      cod_hash_map *map = cod_hash_map_new(flags);
+
+      double t0 = seconds();
+      for (size_t r = 0; r < CHURN_ROUNDS; ++r)
+      {
+        /* Keys are never NULL. */
+        for (size_t i = 1; i <= n; ++i)
+        {
+          char *key = (char*)(uintptr_t)(r * n + i);
+          cod_hash_map_insert(map, key, cod_fmix64(r * n + i), NULL, NULL);
+        }
+        for (size_t i = 1; i <= n; ++i)
+        {
+          if (i % 100 == 0)
+            continue;
+          char *key = (char*)(uintptr_t)(r * n + i);
+          cod_hash_map_erase(map, key, cod_fmix64(r * n + i), NULL);
+        }
+      }
+      double t = seconds() - t0;
+
+      if (map->size != CHURN_ROUNDS * (n / 100))
+        abort();
+      double mb = table_mb(map);
+      cod_hash_map_shrink_to_fit(map);
+      printf("%-8s %-10s %10.1f %10.1f %10.2f\n", engines[e].name,
+          shrink ? "autoshrink" : "-", mb, table_mb(map), t);
+      cod_hash_map_delete(map, NULL);
+    }
+  }
+  printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  int speed = argc < 2, quality = argc < 2;
+  int batch = 0, build = 0, churn = 0;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "speed") == 0)
+      speed = 1;
+    else if (strcmp(argv[i], "quality") == 0)
+      quality = 1;
+    else if (strcmp(argv[i], "batch") == 0)
+      batch = 1;
+    else if (strcmp(argv[i], "build") == 0)
+      build = 1;
+    else if (strcmp(argv[i], "churn") == 0)
+      churn = 1;
+    else
+    {
+      fprintf(stderr, "usage: %s [speed] [quality] [batch] [build] [churn]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (speed)
+    bench_speed();
+  if (quality)
+    bench_quality();
+  if (batch)
+    bench_batch();
+  if (build)
+    bench_build();
+  if (churn)
+    bench_churn();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,228 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Allocation under contention: glibc malloc vs. ualloc (single-threaded one
+ * behind a mutex, and UALLOC_MT).
+ *
+ * Build and run:
+ *   gcc -O2 -pthread -Iinclude bench/ualloc-bench.c -o ualloc-bench
+ *   ./ualloc-bench [npairs]
+ *
+ * Scenarios:
+ *  - local: every thread allocates a batch of objects and frees it itself.
+ *  - handoff: producer threads allocate objects and pass them through a ring
+ *    buffer to consumer threads which free them (cross-thread frees).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+typedef struct { char data[48]; } object;
+
+#define UALLOC_NAME st
+#define UALLOC_TYPE object
+#include "codeine/ualloc.h"
+
+#define UALLOC_NAME mt
+#define UALLOC_TYPE object
+#define UALLOC_MT
+#include "codeine/ualloc.h"
+
+#ifndef NOPS
+# define NOPS 2000000
+#endif
+#define BATCH 256
+#define RING 1024
+
+static struct cod_ualloc_st st_alloc;
+static pthread_mutex_t st_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cod_ualloc_mt mt_alloc;
+
+static object*
+a_malloc(void)
+{ return malloc(sizeof(object)); }
+
+static void
+f_malloc(object *p)
+{ free(p); }
+
+static object*
+a_st(void)
+{
+  pthread_mutex_lock(&st_mutex);
+  object *p = cod_ualloc_st_alloc(&st_alloc);
+  pthread_mutex_unlock(&st_mutex);
+  return p;
+}
+
+static void
+f_st(object *p)
+{
+  pthread_mutex_lock(&st_mutex);
+  cod_ualloc_st_free(&st_alloc, p);
+  pthread_mutex_unlock(&st_mutex);
+}
+
+static object*
+a_mt(void)
+{ return cod_ualloc_mt_alloc(&mt_alloc); }
+
+static void
+f_mt(object *p)
+{ cod_ualloc_mt_free(&mt_alloc, p); }
+
+static const struct {
+  const char *name;
+  object* (*alloc)(void);
+  void (*free)(object*);
+} allocators[] = {
+  { "malloc", a_malloc, f_malloc },
+  { "ualloc+mutex", a_st, f_st },
+  { "ualloc-mt", a_mt, f_mt },
+};
+#define NALLOCATORS (sizeof allocators / sizeof allocators[0])
+
+static int cur;
+
+/******************************************************************************
+ * Local
+ */
+static void*
+local_thread(void *arg)
+{
+  (void)arg;
+  object *batch[BATCH];
+  for (int i = 0; i < NOPS / BATCH; ++i)
+  {
+    for (int j = 0; j < BATCH; ++j)
+    {
+      batch[j] = allocators[cur].alloc();
+      batch[j]->data[0] = j;
+    }
+    for (int j = 0; j < BATCH; ++j)
+      allocators[cur].free(batch[j]);
+  }
+  return NULL;
+}
+
+/******************************************************************************
+ * Handoff
+ */
+typedef struct {
+  object *slots[RING];
+  size_t head, tail; /* written by producer and consumer respectively */
+} ring;
+
+static void*
+producer_thread(void *arg)
+{
+  ring *r = arg;
+  for (size_t i = 0; i < NOPS; ++i)
+  {
+    object *p = allocators[cur].alloc();
+    p->data[0] = i;
+    while (i - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING)
+      sched_yield();
+    r->slots[i % RING] = p;
+    __atomic_store_n(&r->head, i + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static void*
+consumer_thread(void *arg)
+{
+  ring *r = arg;
+  for (size_t i = 0; i < NOPS; ++i)
+  {
+    while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == i)
+      sched_yield();
+    object *p = r->slots[i % RING];
+    if (p->data[0] != (char)i)
+      abort();
+    allocators[cur].free(p);
+    __atomic_store_n(&r->tail, i + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double
+run_local(int nthreads)
+{
+  pthread_t th[nthreads];
+  double t0 = now();
+  for (int i = 0; i < nthreads; ++i)
+    pthread_create(&th[i], NULL, local_thread, NULL);
+  for (int i = 0; i < nthreads; ++i)
+    pthread_join(th[i], NULL);
+  return now() - t0;
+}
+
+static double
+run_handoff(int npairs)
+{
+  pthread_t th[2 * npairs];
+  ring *rings = calloc(npairs, sizeof(ring));
+  double t0 = now();
+  for (int i = 0; i < npairs; ++i)
+  {
+    pthread_create(&th[2 * i], NULL, producer_thread, &rings[i]);
+    pthread_create(&th[2 * i + 1], NULL, consumer_thread, &rings[i]);
+  }
+  for (int i = 0; i < 2 * npairs; ++i)
+    pthread_join(th[i], NULL);
+  double t = now() - t0;
+  free(rings);
+  return t;
+}
+
+int
+main(int argc, char **argv)
+{
+  const int npairs = argc > 1 ? atoi(argv[1]) : 2;
+  if (npairs <= 0)
+  {
+    fprintf(stderr, "usage: %s [npairs]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  printf("wall-clock ns / %d alloc+free per thread\n", NOPS);
+  printf("%-14s %10s %10s %10s\n", "allocator", "local x1",
+      "local xN", "handoff");
+  for (cur = 0; cur < (int)NALLOCATORS; ++cur)
+  {
+    cod_ualloc_st_init(&st_alloc);
+    cod_ualloc_mt_init(&mt_alloc);
+    double t1 = run_local(1) / NOPS * 1e9;
+    double tn = run_local(2 * npairs) / NOPS * 1e9;
+    double th = run_handoff(npairs) / NOPS * 1e9;
+    printf("%-14s %10.1f %10.1f %10.1f\n", allocators[cur].name, t1, tn, th);
+    cod_ualloc_st_destroy(&st_alloc);
+    cod_ualloc_mt_destroy(&mt_alloc);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,234 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Word counting: find() followed by insert() on a miss, against the single
+ * lookup of cod_hash_map_entry() and cod_hash_map_upsert().
+ *
+ * Build and run:
+ *   gcc -O2 -Iinclude bench/wordcount-bench.c src/hash-map.c src/hash64.c \
+ *       -o wordcount-bench
+ *   ./wordcount-bench [file]
+ *
+ * Words are split at whitespace of the file; without one, NWORDS words are
+ * drawn from a Zipf distribution over a vocabulary of VOCAB words, roughly
+ * like in natural text. Figures are ns per word.
+ */
+#include "codeine/hash-map.h"
+#include "codeine/hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#ifndef NWORDS
+# define NWORDS 10000000
+#endif
+#ifndef VOCAB
+# define VOCAB 200000
+#endif
+
+typedef struct {
+  const char *ptr;
+  size_t len;
+  uint32_t hash;
+} word;
+
+static const struct {
+  const char *name;
+  int flags;
+} engines[] = {
+  { "chain", 0 },
+  { "flat", COD_HASH_MAP_FLAT },
+  { "ordered", COD_HASH_MAP_ORDERED },
+};
+#define NENGINES (sizeof engines / sizeof engines[0])
+
+static double
+seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char*
+read_file(const char *path, size_t *size)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+  fseek(file, 0, SEEK_END);
+  *size = ftell(file);
+  rewind(file);
+  char *text = malloc(*size + 1);
+  *size = fread(text, 1, *size, file);
+  text[*size] = 0;
+  fclose(file);
+  return text;
+}
+
+/* Words of rank r are written in base 26, so frequent words are short. */
+static char*
+zipf_text(size_t *size)
+{
+  double *cdf = malloc(sizeof(double) * VOCAB);
+  double sum = 0;
+  for (size_t r = 0; r < VOCAB; ++r)
+    cdf[r] = sum += 1.0 / (r + 1);
+
+  char *text = malloc((size_t)NWORDS * 6 + 1);
+  char *p = text;
+  uint64_t state = 0x243f6a8885a308d3ull;
+  for (size_t i = 0; i < NWORDS; ++i)
+  {
+    state += 0x9e3779b97f4a7c15ull;
+    double u = (cod_fmix64(state) >> 11) * 0x1p-53 * sum;
+    size_t lo = 0, hi = VOCAB - 1;
+    while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (cdf[mid] < u)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    for (size_t r = lo; ; r /= 26)
+    {
+      *p++ = 'a' + r % 26;
+      if (r < 26)
+        break;
+    }
+    *p++ = ' ';
+  }
+  *p = 0;
+  *size = p - text;
+  free(cdf);
+  return text;
+}
+
+static word*
+split(const char *text, size_t size, size_t *n)
+{
+  word *words = malloc(sizeof(word) * (size / 2 + 1));
+  *n = 0;
+  for (size_t i = 0; i < size; )
+  {
+    while (i < size && isspace((unsigned char)text[i]))
+      ++i;
+    size_t start = i;
+    while (i < size && !isspace((unsigned char)text[i]))
+      ++i;
+    if (i > start)
+    {
+      word *w = &words[(*n)++];
+      w->ptr = text + start;
+      w->len = i - start;
+      w->hash = cod_hash_map_hash_n(w->ptr, w->len);
+    }
+  }
+  return words;
+}
+
+static void*
+add(void *old, void *val)
+{ return (void*)((intptr_t)old + (intptr_t)val); }
+
+/* Count the words and return the sum of counts (the number of words). */
+static size_t
+count(int flags, int method, const word *words, size_t n, size_t *nunique)
+{
+  cod_hash_map *map = cod_hash_map_new(flags);
+  for (size_t i = 0; i < n; ++i)
+  {
+    const word *w = &words[i];
+    cod_hash_map_elt *elt;
+    switch (method)
+    {
+      case 0:
+        elt = cod_hash_map_find_n(map, w->ptr, w->len, w->hash);
+        if (elt)
+          elt->val = (void*)((intptr_t)elt->val + 1);
+        else
+          cod_hash_map_insert_n(map, w->ptr, w->len, w->hash, (void*)1, NULL);
+        break;
+
+      case 1:
+        elt = cod_hash_map_entry_n(map, w->ptr, w->len, w->hash, NULL);
+        elt->val = (void*)((intptr_t)elt->val + 1);
+        break;
+
+      default:
+        cod_hash_map_upsert_n(map, w->ptr, w->len, w->hash, (void*)1, add);
+        break;
+    }
+  }
+
+  size_t total = 0;
+  cod_hash_map_iter iter;
+  char *key;
+  void *val;
+  cod_hash_map_begin(map, &iter);
+  while (cod_hash_map_next(map, &key, &val, &iter))
+    total += (intptr_t)val;
+  *nunique = map->size;
+  cod_hash_map_delete(map, NULL);
+  return total;
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc > 2)
+  {
+    fprintf(stderr, "usage: %s [file]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  size_t size;
+  char *text = argc > 1 ? read_file(argv[1], &size) : zipf_text(&size);
+  if (text == NULL)
+  {
+    perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+  size_t n;
+  word *words = split(text, size, &n);
+
+  static const char *methods[] = { "find+insert", "entry", "upsert" };
+  size_t nunique = 0;
+  double t[3];
+  printf("ns/word, %zu words\n", n);
+  printf("%-8s %12s %12s %12s\n", "engine", methods[0], methods[1],
+      methods[2]);
+  for (size_t e = 0; e < NENGINES; ++e)
+  {
+    for (int m = 0; m < 3; ++m)
+    {
+      double t0 = seconds();
+      if (count(engines[e].flags, m, words, n, &nunique) != n)
+        abort();
+      t[m] = (seconds() - t0) / n * 1e9;
+    }
+    printf("%-8s %12.1f %12.1f %12.1f\n", engines[e].name, t[0], t[1], t[2]);
+  }
+  printf("%zu distinct words\n", nunique);
+
+  free(words);
+  free(text);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,151 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Region (bump) allocator.
+ *
+ * Memory is handed out from a chain of chunks and released all at once, by
+ * cod_arena_reset() or by rewinding to a mark. Chunks are kept for reuse until
+ * cod_arena_destroy(). The last allocation can be grown or shrunk in place.
+ *
+ * Containers can be backed by an arena by compiling them with
+ * COD_ARENA_BACKEND defined (see common.h): then cod_malloc() and friends
+ * allocate from the arena made current in the calling thread by
+ * cod_arena_use(), or from the heap if there is none. A block must be
+ * reallocated and freed while the arena it came from is current. Single
+ * containers can be given an arena by cod_arena_allocator().
+ */
+#ifndef COD_ARENA_H
+#define COD_ARENA_H
+
+#include "codeine/common.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef COD_ARENA_CHUNK
+# define COD_ARENA_CHUNK 0x10000
+#endif
+
+/* Default alignment (enough for any scalar type). */
+#define COD_ARENA_ALIGN 16
+
+typedef struct cod_arena_chunk cod_arena_chunk;
+
+typedef struct {
+  cod_arena_chunk *head, *cur;
+  char *ptr, *end; /* free space in the current chunk */
+  char *last; /* the last allocation, or NULL */
+  size_t chunk_size;
+} cod_arena;
+
+typedef struct {
+  cod_arena_chunk *chunk;
+  char *ptr;
+} cod_arena_mark;
+
+/**
+ * \brief Initialize an arena allocating chunks of `chunk_size` bytes (or
+ * COD_ARENA_CHUNK if 0).
+ *
+ * No memory is allocated until the first allocation.
+ */
+void
+cod_arena_init(cod_arena *arena, size_t chunk_size);
+
+void
+cod_arena_destroy(cod_arena *arena);
+
+void*
+cod_arena_alloc_slow(cod_arena *arena, size_t size, size_t align);
+
+/**
+ * \brief Allocate `size` bytes aligned to `align` (a power of two).
+ */
+static inline void*
+cod_arena_alloc_aligned(cod_arena *arena, size_t size, size_t align)
+{
+  uintptr_t p = ((uintptr_t)arena->ptr + align - 1) & ~(uintptr_t)(align - 1);
+  uintptr_t end = (uintptr_t)arena->end;
+  if (__builtin_expect(p <= end && size <= end - p && arena->ptr, 1))
+  {
+    arena->ptr = (char*)p + size;
+    return arena->last = (char*)p;
+  }
+  return cod_arena_alloc_slow(arena, size, align);
+}
+
+static inline void*
+cod_arena_alloc(cod_arena *arena, size_t size)
+{ return cod_arena_alloc_aligned(arena, size, COD_ARENA_ALIGN); }
+
+/**
+ * \brief Resize a block of `oldsize` bytes.
+ *
+ * The last allocation is resized in place if it fits into its chunk; other
+ * blocks are copied (unless shrunk).
+ */
+void*
+cod_arena_realloc(cod_arena *arena, void *ptr, size_t oldsize, size_t newsize);
+
+static inline cod_arena_mark
+cod_arena_get_mark(const cod_arena *arena)
+{ return (cod_arena_mark) { arena->cur, arena->ptr }; }
+
+/**
+ * \brief Release everything allocated after the mark was taken.
+ */
+void
+cod_arena_rewind(cod_arena *arena, cod_arena_mark mark);
+
+/**
+ * \brief Release all allocations at once (keeping the chunks).
+ */
+void
+cod_arena_reset(cod_arena *arena);
+
+/**
+ * \brief Make `arena` current for the calling thread (NULL for the heap).
+ *
+ * \return The previously current arena.
+ */
+cod_arena*
+cod_arena_use(cod_arena *arena);
+
+/*
+ * malloc()-compatible functions working with the current arena. Blocks are
+ * prefixed with their size, so that they can be reallocated without knowing it.
+ * Freeing the last block returns its memory; others are kept until reset.
+ */
+void*
+cod_arena_malloc(size_t size);
+
+void*
+cod_arena_calloc(size_t n, size_t size);
+
+void*
+cod_arena_realloc_block(void *ptr, size_t size);
+
+void
+cod_arena_free(void *ptr);
+
+/**
+ * \brief Get allocator for containers, allocating from the arena (same as
+ * the functions above, but not depending on the current arena).
+ */
+cod_allocator
+cod_arena_allocator(cod_arena *arena);
+
+#endif
@@ -0,0 +1,173 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Concurrent hash map.
+ *
+ * The map is split into shards selected by the high bits of the hash. Each
+ * shard is a chaining table like cod_hash_map, but its buckets are immutable:
+ * writers (serialized by a per-shard mutex) publish modified copies of buckets,
+ * or a whole new table on resize. Readers take no locks at all. Memory replaced
+ * by writers (buckets, tables, erased keys and values) is reclaimed only after
+ * every reader that could still see it has left its critical section
+ * (epoch-based reclamation).
+ *
+ * Usage:
+ * ```
+ * cod_chash_map *map = cod_chash_map_new(0, 64);
+ * ...
+ * // each reading thread
+ * cod_chash_reader *r = cod_chash_map_reader(map);
+ * cod_chash_map_enter(map, r);
+ * void *val;
+ * if (cod_chash_map_find(map, key, hash, &val))
+ *   use(val); // `val` stays valid until cod_chash_map_leave()
+ * cod_chash_map_leave(map, r);
+ * ...
+ * cod_chash_map_release_reader(map, r);
+ * ```
+ */
+#ifndef COD_CHASH_MAP_H
+#define COD_CHASH_MAP_H
+
+#include "codeine/common.h"
+#include "codeine/hash-map.h"
+
+#include <pthread.h>
+
+#ifndef COD_CHASH_MAP_MAX_READERS
+# define COD_CHASH_MAP_MAX_READERS 256
+#endif
+
+/* Number of retired objects after which a writer attempts to reclaim them. */
+#ifndef COD_CHASH_MAP_RECLAIM_BATCH
+# define COD_CHASH_MAP_RECLAIM_BATCH 64
+#endif
+
+typedef struct cod_chash_table cod_chash_table;
+
+typedef struct {
+  void *ptr;
+  void (*dtor)(void*);
+  uint64_t epoch;
+} cod_chash_retired;
+
+typedef struct {
+  pthread_mutex_t lock;
+  cod_chash_table *table;
+  size_t size;
+  cod_vec(cod_chash_retired) limbo;
+} __attribute__((aligned(64))) cod_chash_shard;
+
+typedef struct {
+  uint64_t epoch; /* epoch of entered critical section, or 0 */
+  int used;
+} __attribute__((aligned(64))) cod_chash_reader;
+
+typedef struct {
+  int flags; /* COD_HASH_MAP_INTKEYS */
+  unsigned nshards, shard_shift;
+  cod_chash_shard *shards;
+  uint64_t epoch __attribute__((aligned(64)));
+  unsigned nreaders; /* high-water mark of claimed reader slots */
+  cod_chash_reader readers[COD_CHASH_MAP_MAX_READERS];
+} cod_chash_map;
+
+/**
+ * \brief Create new concurrent map.
+ *
+ * \param flags Only COD_HASH_MAP_INTKEYS is supported.
+ * \param nshards Number of shards (will be rounded up to a power of 2).
+ */
+cod_chash_map*
+cod_chash_map_new(int flags, unsigned nshards);
+
+/**
+ * \brief Destroy the map.
+ *
+ * No other thread may access the map at this point.
+ */
+void
+cod_chash_map_delete(cod_chash_map *map, void (*dtor)(void*));
+
+/**
+ * \brief Claim a reader slot for the calling thread.
+ *
+ * Returns NULL if all `COD_CHASH_MAP_MAX_READERS` slots are taken.
+ */
+cod_chash_reader*
+cod_chash_map_reader(cod_chash_map *map);
+
+void
+cod_chash_map_release_reader(cod_chash_map *map, cod_chash_reader *reader);
+
+/**
+ * \brief Enter read-side critical section.
+ *
+ * Values returned by find-functions remain valid until the matching
+ * cod_chash_map_leave().
+ */
+static inline void
+cod_chash_map_enter(cod_chash_map *map, cod_chash_reader *reader)
+{
+  uint64_t epoch = __atomic_load_n(&map->epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&reader->epoch, epoch, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+cod_chash_map_leave(cod_chash_map *map, cod_chash_reader *reader)
+{
+  (void)map;
+  __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Lock-free lookup.
+ *
+ * Must be called inside of a read-side critical section.
+ */
+int
+cod_chash_map_find_n(cod_chash_map *map, const void *key, size_t len,
+    uint32_t hash, void **val);
+
+int
+cod_chash_map_find(cod_chash_map *map, const char *key, uint32_t hash,
+    void **val);
+
+/**
+ * \brief Insert (or replace, if `dtor` is given) a value.
+ *
+ * Destruction of replaced value is deferred until no reader can observe it.
+ */
+int
+cod_chash_map_insert_n(cod_chash_map *map, const void *key, size_t len,
+    uint32_t hash, void *val, void (*dtor)(void*));
+
+int
+cod_chash_map_insert(cod_chash_map *map, const char *key, uint32_t hash,
+    void *val, void (*dtor)(void*));
+
+int
+cod_chash_map_erase_n(cod_chash_map *map, const void *key, size_t len,
+    uint32_t hash, void (*dtor)(void*));
+
+int
+cod_chash_map_erase(cod_chash_map *map, const char *key, uint32_t hash,
+    void (*dtor)(void*));
+
+size_t
+cod_chash_map_size(cod_chash_map *map);
+
+#endif
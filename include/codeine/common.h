@@ -16,9 +16,28 @@
 #ifndef CODEINE_COMMON_H
 #define CODEINE_COMMON_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Allocate from the current arena of the thread (see arena.h). */
+#ifdef COD_ARENA_BACKEND
+void* cod_arena_malloc(size_t size);
+void* cod_arena_calloc(size_t n, size_t size);
+void* cod_arena_realloc_block(void *ptr, size_t size);
+void cod_arena_free(void *ptr);
+# define cod_malloc cod_arena_malloc
+# define cod_calloc cod_arena_calloc
+# define cod_realloc cod_arena_realloc_block
+# define cod_free cod_arena_free
+#endif
+
 #ifndef cod_malloc
 # include <stdlib.h>
 # define cod_malloc malloc
+# ifndef cod_calloc
+#  define cod_calloc calloc
+# endif
 #endif
 
 #ifndef cod_realloc
@@ -31,10 +50,67 @@
 # define cod_free free
 #endif
 
+/* With custom cod_malloc(), zeroed memory must come from it as well, so that
+ * it can be released by the matching cod_free(). */
+#ifndef cod_calloc
+static inline void*
+cod_calloc(size_t n, size_t size)
+{
+  if (size && n > SIZE_MAX / size)
+    return NULL;
+  void *p = cod_malloc(n * size);
+  if (p)
+    memset(p, 0, n * size);
+  return p;
+}
+#endif
+
 #define cod_likely(expr) __builtin_expect(!!(expr), 1)
 #define cod_unlikely(expr) __builtin_expect((expr), 0)
 
-#include <stdint.h>
+/**
+ * \brief Allocator of a single container.
+ *
+ * Containers created with an allocator take all their memory from it;
+ * with NULL they use cod_malloc() & co. The allocator must outlive the
+ * container.
+ */
+typedef struct {
+  void* (*alloc)(void *ctx, size_t size);
+  void* (*realloc)(void *ctx, void *ptr, size_t size);
+  void (*free)(void *ctx, void *ptr);
+  void *ctx;
+} cod_allocator;
+
+static inline void*
+cod_alloc_with(const cod_allocator *a, size_t size)
+{ return a ? a->alloc(a->ctx, size) : cod_malloc(size); }
+
+static inline void*
+cod_calloc_with(const cod_allocator *a, size_t n, size_t size)
+{
+  if (a == NULL)
+    return cod_calloc(n, size);
+  if (size && n > SIZE_MAX / size)
+    return NULL;
+  void *p = a->alloc(a->ctx, n * size);
+  if (p)
+    memset(p, 0, n * size);
+  return p;
+}
+
+static inline void*
+cod_realloc_with(const cod_allocator *a, void *ptr, size_t size)
+{ return a ? a->realloc(a->ctx, ptr, size) : cod_realloc(ptr, size); }
+
+static inline void
+cod_free_with(const cod_allocator *a, void *ptr)
+{
+  if (a)
+    a->free(a->ctx, ptr);
+  else
+    cod_free(ptr);
+}
 
 static inline uint8_t __attribute__((pure))
 cod_log2_u64(uint64_t x)
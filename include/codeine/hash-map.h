@@ -18,6 +18,9 @@
 
 #include "codeine/common.h"
 #include "codeine/vec.h"
+#include "codeine/hash.h"
+
+#include <string.h>
 
 /**
  * \brief With this flag set, keys will be treated as integers, not strings.
@@ -28,13 +31,113 @@
  */
 #define COD_HASH_MAP_INTKEYS 0x01
 
-static void
+/**
+ * \brief Use flat open-addressing table instead of separate chaining.
+ *
+ * Elements are stored inline in a single array of slots, accompanied by an
+ * array of control bytes (7-bit hash tag, or empty/deleted marker). Lookups
+ * probe 16 slots at a time with SSE2/NEON compares on the control bytes.
+ *
+ * Note: with this flag, `cod_hash_map_iter::buckidx` is the slot index.
+ */
+#define COD_HASH_MAP_FLAT 0x02
+
+/**
+ * \brief Resize incrementally instead of rebuilding the whole table at once.
+ *
+ * When the table has to grow, the old bucket array is kept alongside the new
+ * one, and each subsequent insert/erase migrates at most
+ * `COD_HASH_MAP_REHASH_STEP` non-empty buckets. Lookups check both tables until
+ * the migration is complete. Only affects the chaining engine.
+ */
+#define COD_HASH_MAP_INCREMENTAL 0x04
+
+#ifndef COD_HASH_MAP_REHASH_STEP
+# define COD_HASH_MAP_REHASH_STEP 1
+#endif
+
+/**
+ * \brief Store copies of string keys in a per-map arena.
+ *
+ * Keys are bump-allocated from chunks of `COD_HASH_MAP_KEY_CHUNK` bytes and
+ * released in bulk by cod_hash_map_delete(). Memory of erased keys is reclaimed
+ * by compaction of live keys once it outweighs them.
+ *
+ * Note: keys passed to cod_hash_map_insert_drain() are copied into the arena
+ * and freed right away.
+ */
+#define COD_HASH_MAP_KEY_ARENA 0x08
+
+#ifndef COD_HASH_MAP_KEY_CHUNK
+# define COD_HASH_MAP_KEY_CHUNK 0x10000
+#endif
+
+/**
+ * \brief Make cod_hash_map_build() partition input by bucket index first.
+ *
+ * Elements are then placed bucket after bucket, so that writes into the table
+ * are sequential. Costs an extra index array of `n` entries.
+ */
+#define COD_HASH_MAP_PARTITION 0x10
+
+/**
+ * \brief Halve the table when it becomes sparse after erases.
+ *
+ * Chaining table shrinks when average chain length drops below 1/4 (it grows
+ * at 3), and the flat one when load factor drops below 1/8 (it grows at 7/8).
+ * With COD_HASH_MAP_INCREMENTAL shrinking is incremental as well.
+ */
+#define COD_HASH_MAP_AUTOSHRINK 0x20
+
+/**
+ * \brief Keep elements in a dense array in the order of insertion.
+ *
+ * The hash table then holds only indices into this array, in slots of 1, 2, 4
+ * or 8 bytes depending on the table size. Iteration is a linear scan of the
+ * array, and enumerates elements in the order they were inserted (replacing
+ * a value keeps the position). Erased elements leave holes which are dropped
+ * when the array is reallocated. Can't be combined with COD_HASH_MAP_FLAT.
+ *
+ * Note: with this flag, `cod_hash_map_iter::buckidx` is the element index.
+ */
+#define COD_HASH_MAP_ORDERED 0x40
+
+/**
+ * \brief Number of elements kept by a chaining map in a single bucket.
+ *
+ * New chaining maps start with a single bucket stored inside of the map
+ * structure, i.e. a plain array searched by comparing hashes. The map is
+ * switched to a regular table once it holds this many elements.
+ */
+#ifndef COD_HASH_MAP_SMALL
+# define COD_HASH_MAP_SMALL 8
+#endif
+
+static inline void
 cod_dummy_dtor(void* _) { }
 
+#ifndef COD_HASH_MAP_SEED
+# define COD_HASH_MAP_SEED 0
+#endif
+
+/**
+ * \brief Default hash of string keys (see cod_hash64()).
+ *
+ * Integer keys (COD_HASH_MAP_INTKEYS) are better hashed with cod_fmix64().
+ */
+static inline uint32_t
+cod_hash_map_hash_n(const void *key, size_t len)
+{ return cod_hash64(key, len, COD_HASH_MAP_SEED); }
+
+static inline uint32_t
+cod_hash_map_hash(const char *key)
+{ return cod_hash_map_hash_n(key, strlen(key)); }
+
 typedef struct {
-  char *key;
+  char *key; /* always zero-terminated (unless COD_HASH_MAP_INTKEYS) */
   void *val;
   uint32_t hash;
+  uint32_t klen; /* key length (excluding terminating zero) */
 } cod_hash_map_elt;
 
 typedef cod_vec(cod_hash_map_elt) cod_bucket;
@@ -43,15 +146,93 @@ typedef struct {
   int buckidx, eltidx;
 } cod_hash_map_iter;
 
+typedef struct cod_key_chunk cod_key_chunk;
+
+/**
+ * \brief Counters maintained when the library is built with
+ * `COD_HASH_MAP_STATS` defined.
+ *
+ * Note: the macro changes layout of cod_hash_map, so it must be defined the
+ * same way for the library and its users.
+ */
+typedef struct {
+  uint64_t hits, misses; /* key lookups (by find, insert and erase) */
+  uint64_t probes; /* elements whose hash/key was compared by lookups */
+  uint64_t rehashes; /* table reallocations (incl. shrinking) */
+  uint64_t rehash_ns; /* time spent moving elements between tables */
+} cod_hash_map_counters;
+
 typedef struct {
   size_t size, cap;
   cod_bucket *restrict data;
+  const cod_allocator *allocator; /* NULL for cod_malloc() & co */
   int flags;
+  /* COD_HASH_MAP_INCREMENTAL: */
+  cod_bucket *olddata; /* table being migrated, or NULL */
+  size_t oldcap;
+  size_t rehashidx; /* next bucket of the old table to migrate */
+  /* COD_HASH_MAP_FLAT: */
+  cod_hash_map_elt *slots;
+  int8_t *ctrl;
+  size_t ntomb; /* number of deleted slots */
+  /* COD_HASH_MAP_ORDERED: */
+  cod_hash_map_elt *entries;
+  size_t nentries; /* used part of `entries` (including erased ones) */
+  void *index;
+  /* COD_HASH_MAP_KEY_ARENA: */
+  cod_key_chunk *keys;
+  size_t keys_live, keys_garbage; /* bytes of live and erased keys */
+  cod_bucket small; /* the table of a small map (see COD_HASH_MAP_SMALL) */
+#ifdef COD_HASH_MAP_STATS
+  cod_hash_map_counters counters;
+#endif
 } cod_hash_map;
 
 cod_hash_map*
 cod_hash_map_new(int flags);
 
+/**
+ * \brief Create a map able to hold `n` elements without growing.
+ */
+cod_hash_map*
+cod_hash_map_new_with_capacity(int flags, size_t n);
+
+/**
+ * \brief Create a map taking its memory (tables and copies of keys) from
+ * `allocator`, or from cod_malloc() & co if it is NULL.
+ *
+ * The allocator is referenced by the map and must outlive it. Keys passed to
+ * cod_hash_map_insert_drain() must come from the same allocator.
+ */
+cod_hash_map*
+cod_hash_map_new_with_allocator(int flags, size_t n,
+    const cod_allocator *allocator);
+
+/**
+ * \brief Grow the table (at once) to hold `n` elements without further growth.
+ */
+void
+cod_hash_map_reserve(cod_hash_map *map, size_t n);
+
+/**
+ * \brief Create a map from arrays of `n` keys, their hashes, and values.
+ *
+ * The table is sized once, and elements are placed without checks for
+ * duplicates, so keys MUST be unique. `vals` may be NULL.
+ */
+cod_hash_map*
+cod_hash_map_build(int flags, const char *const *keys, const uint32_t *hashes,
+    void *const *vals, size_t n);
+
+/**
+ * \brief Rebuild the table at the smallest size holding current elements.
+ *
+ * Chains are reallocated at their exact sizes, tombstones of the flat table
+ * are dropped, and memory of erased keys in the key arena is reclaimed.
+ */
+void
+cod_hash_map_shrink_to_fit(cod_hash_map *map);
+
 void
 cod_hash_map_delete(cod_hash_map *restrict map, void (*dtor)(void*));
 
@@ -59,17 +240,89 @@ int
 cod_hash_map_insert(cod_hash_map *map, const char *key, size_t hash, void *val,
     void (*dtor)(void*));
 
+/**
+ * \brief Insert a key given by explicit length.
+ *
+ * Key may contain arbitrary bytes and is not required to be zero-terminated;
+ * the stored copy is zero-terminated nevertheless. String keys are compared by
+ * length first, then with memcmp(), so the same key can be accessed via both
+ * this and zero-terminated interfaces.
+ */
+int
+cod_hash_map_insert_n(cod_hash_map *map, const void *key, size_t len,
+    size_t hash, void *val, void (*dtor)(void*));
+
 int
 cod_hash_map_insert_drain(cod_hash_map *map, char *key, size_t hash, void *val,
     void (*dtor)(void*));
 
+/**
+ * \brief Find the element of the key, inserting it if missing.
+ *
+ * Takes a single lookup. A new element gets a copy of the key and NULL value,
+ * and `*inserted` (if given) tells whether the element is new. The pointer
+ * remains valid until the next insertion or erasure.
+ *
+ * Usage:
+ * ```
+ * cod_hash_map_elt *elt = cod_hash_map_entry(map, word, hash, NULL);
+ * elt->val = (void*)((intptr_t)elt->val + 1);
+ * ```
+ */
+cod_hash_map_elt*
+cod_hash_map_entry(cod_hash_map *map, const char *key, uint32_t hash,
+    int *inserted);
+
+cod_hash_map_elt*
+cod_hash_map_entry_n(cod_hash_map *map, const void *key, size_t len,
+    uint32_t hash, int *inserted);
+
+/**
+ * \brief Insert the value, or replace existing one with `merge(old, val)`.
+ *
+ * \return 1 if the key was inserted.
+ */
+int
+cod_hash_map_upsert(cod_hash_map *map, const char *key, uint32_t hash,
+    void *val, void* (*merge)(void *old, void *val));
+
+int
+cod_hash_map_upsert_n(cod_hash_map *map, const void *key, size_t len,
+    uint32_t hash, void *val, void* (*merge)(void *old, void *val));
+
 int
 cod_hash_map_erase(cod_hash_map *map, const char *key, size_t hash,
     void (*dtor)(void*));
 
+int
+cod_hash_map_erase_n(cod_hash_map *map, const void *key, size_t len,
+    size_t hash, void (*dtor)(void*));
+
 cod_hash_map_elt*
 cod_hash_map_find(const cod_hash_map *map, const char *key, uint32_t hash);
 
+cod_hash_map_elt*
+cod_hash_map_find_n(const cod_hash_map *map, const void *key, size_t len,
+    uint32_t hash);
+
+#ifndef COD_HASH_MAP_BATCH
+# define COD_HASH_MAP_BATCH 16
+#endif
+
+/**
+ * \brief Look up `n` keys at once.
+ *
+ * Keys are processed in groups of `COD_HASH_MAP_BATCH`: bucket indices are
+ * computed and prefetched for the whole group first, then element arrays, then
+ * the keys, and only then the keys are compared. This way memory latency of
+ * one lookup overlaps with work on the others.
+ *
+ * Results (same as of cod_hash_map_find()) are written into `out`.
+ */
+void
+cod_hash_map_find_batch(const cod_hash_map *map, const char *const *keys,
+    const uint32_t *hashes, size_t n, cod_hash_map_elt **out);
+
 void
 cod_hash_map_begin(const cod_hash_map *map, cod_hash_map_iter *iter);
 
@@ -77,4 +330,121 @@ int
 cod_hash_map_next(const cod_hash_map *map, char **key, void *val,
     cod_hash_map_iter *iter);
 
+#ifndef COD_HASH_MAP_STAT_HIST
+# define COD_HASH_MAP_STAT_HIST 16
+#endif
+
+typedef struct {
+  size_t size;
+  size_t cap; /* buckets, or slots with COD_HASH_MAP_FLAT/ORDERED */
+  double load_factor; /* size / cap */
+  /* Number of buckets with chain of length i; last entry accounts for all
+   * longer chains. With COD_HASH_MAP_FLAT (ORDERED): number of elements found
+   * at i-th probed group (slot). */
+  size_t hist[COD_HASH_MAP_STAT_HIST];
+  size_t max_chain; /* or longest probe sequence (in groups) */
+  double mean_chain; /* over non-empty buckets, or mean probe length */
+  size_t key_bytes; /* memory held by copies of keys */
+  size_t table_bytes; /* bucket arrays and chains, or slots */
+  cod_hash_map_counters counters; /* all zero without COD_HASH_MAP_STATS */
+} cod_hash_map_stat;
+
+/**
+ * \brief Collect statistics of the table.
+ *
+ * Walks over the whole table. Counters are only maintained if the library is
+ * compiled with `COD_HASH_MAP_STATS`, so that there are no costs on the hot
+ * paths otherwise.
+ */
+void
+cod_hash_map_stats(const cod_hash_map *map, cod_hash_map_stat *stat);
+
+/**
+ * \brief Reset counters (if enabled).
+ */
+void
+cod_hash_map_reset_stats(cod_hash_map *map);
+
+/******************************************************************************
+ * Snapshots
+ *
+ * cod_hash_map_save() writes the map into a file holding a header, a table of
+ * bucket offsets, elements sorted by bucket, and the keys. Everything is
+ * addressed by offsets, so cod_hash_map_open_mmap() only has to map the file
+ * to serve lookups from it. Pages are loaded on demand and shared between
+ * processes opening the same snapshot.
+ *
+ * Values are stored as is, as 64-bit words: this is only meaningful for
+ * integers casted to pointers (or offsets into some other data).
+ */
+typedef struct {
+  uint32_t hash;
+  uint32_t klen;
+  uint64_t key; /* offset into the key section (or integer key) */
+  uint64_t val;
+} cod_hash_map_mmap_elt;
+
+typedef struct {
+  void *base;
+  size_t mapsize;
+  int flags; /* COD_HASH_MAP_INTKEYS */
+  size_t size;
+  size_t nbuckets;
+  const uint64_t *buckets; /* elements of bucket i are [buckets[i], buckets[i+1]) */
+  const cod_hash_map_mmap_elt *elts;
+  const char *keys;
+  size_t keys_size;
+} cod_hash_map_mmap;
+
+/**
+ * \brief Write the map into a snapshot file.
+ *
+ * The file is written under a unique temporary name, synced to disk and then
+ * renamed into `path`, so processes having the old snapshot mapped are not
+ * affected, and concurrent saves to the same path don't interfere. The file
+ * is created with mode 0644.
+ *
+ * \return 0 on success, or -1 with `errno` set.
+ */
+int
+cod_hash_map_save(const cod_hash_map *map, const char *path);
+
+/**
+ * \brief Map a snapshot file for reading.
+ *
+ * Only the header is checked here; buckets and keys are checked by lookups as
+ * they reach them, so a damaged snapshot yields misses rather than reads out
+ * of bounds.
+ *
+ * \return NULL with `errno` set on failure (EINVAL if the file is not a valid
+ * snapshot).
+ */
+cod_hash_map_mmap*
+cod_hash_map_open_mmap(const char *path);
+
+void
+cod_hash_map_close_mmap(cod_hash_map_mmap *map);
+
+const cod_hash_map_mmap_elt*
+cod_hash_map_mmap_find_n(const cod_hash_map_mmap *map, const void *key,
+    size_t len, uint32_t hash);
+
+const cod_hash_map_mmap_elt*
+cod_hash_map_mmap_find(const cod_hash_map_mmap *map, const char *key,
+    uint32_t hash);
+
+/**
+ * \brief Get key of a snapshot element (zero-terminated string, or integer
+ * casted to pointer with COD_HASH_MAP_INTKEYS).
+ */
+static inline const char*
+cod_hash_map_mmap_key(const cod_hash_map_mmap *map,
+    const cod_hash_map_mmap_elt *elt)
+{
+  if (map->flags & COD_HASH_MAP_INTKEYS)
+    return (const char*)(uintptr_t)elt->key;
+  else
+    return map->keys + elt->key;
+}
+
 #endif
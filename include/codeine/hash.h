@@ -36,7 +36,7 @@ cod_djb2(const char *str)
 /*
  * source: http://www.cse.yorku.ca/~oz/hash.html
  */
-static unsigned long
+static inline unsigned long
 cod_sdbm(const char *str)
 {
   unsigned long hash = 0;
@@ -48,7 +48,91 @@ cod_sdbm(const char *str)
   return hash;
 }
 
+/*
+ * Finalizer of MurmurHash3: every input bit affects every output bit, so it
+ * turns sequential integers into well spread hashes.
+ * source: https://github.com/aappleby/smhasher/blob/master/src/MurmurHash3.cpp
+ */
+static inline uint64_t
+cod_fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+/**
+ * \brief Fast 64-bit hash of `len` bytes.
+ *
+ * Mixes 16-32 bytes per step for short inputs, and uses SIMD (selected at run
+ * time) for inputs over 128 bytes. Not suitable against hash flooding by
+ * untrusted input unless `seed` is kept secret.
+ */
+uint64_t
+cod_hash64(const void *ptr, size_t len, uint64_t seed);
+
 uint32_t
 cod_halfsiphash(const uint8_t key[16], const uint8_t *m, size_t len);
 
+/**
+ * \brief State of incremental cod_halfsiphash().
+ */
+typedef struct {
+  uint32_t v[4];
+  uint32_t tail; /* bytes of the incomplete word (little endian) */
+  size_t len; /* total number of bytes so far */
+} cod_halfsiphash_state;
+
+void
+cod_halfsiphash_init(cod_halfsiphash_state *st, const uint8_t key[16]);
+
+/**
+ * \brief Feed next fragment of the message.
+ *
+ * Fragments may have any length; a partial 4-byte word is carried over to the
+ * next call.
+ */
+void
+cod_halfsiphash_update(cod_halfsiphash_state *st, const void *ptr, size_t len);
+
+/**
+ * \brief Get the hash of all fed bytes.
+ *
+ * Same as cod_halfsiphash() of their concatenation. The state is left intact,
+ * so more data may be appended afterwards.
+ */
+uint32_t
+cod_halfsiphash_final(const cod_halfsiphash_state *st);
+
+/**
+ * \brief Compute cod_halfsiphash() of four messages at once.
+ *
+ * Messages are processed in SSE2 lanes and may have different lengths; the
+ * results are identical to the ones of cod_halfsiphash().
+ */
+void
+cod_halfsiphash_x4(const uint8_t key[16], const uint8_t *const m[4],
+    const size_t len[4], uint32_t out[4]);
+
+/**
+ * \brief Compute cod_halfsiphash() of eight messages at once (AVX2 if
+ * available at run time).
+ */
+void
+cod_halfsiphash_x8(const uint8_t key[16], const uint8_t *const m[8],
+    const size_t len[8], uint32_t out[8]);
+
+/**
+ * \brief Compute cod_halfsiphash() of `n` messages, eight or four at a time.
+ *
+ * Lanes run for as many rounds as the longest message in the group needs, so
+ * it pays off best when lengths are similar.
+ */
+void
+cod_halfsiphash_batch(const uint8_t key[16], const uint8_t *const *m,
+    const size_t *len, size_t n, uint32_t *out);
+
 #endif
@@ -0,0 +1,334 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Generic hash map.
+ *
+ * Keys and values are stored inline in a single open-addressing table (linear
+ * probing), next to an array of control bytes holding 7-bit hash tags.
+ *
+ * USAGE:
+ * 1) #define HMAP_KEY, HMAP_VAL, HMAP_HASH and HMAP_NAME:
+ *    - HMAP_KEY and HMAP_VAL are the types of keys and values,
+ *    - HMAP_HASH(key) is an expression computing hash of a key (of an integer
+ *      type); it is additionally scrambled by the map, so e.g. identity is fine
+ *      for integer keys,
+ *    - HMAP_EQ(a, b) (optional) compares two keys; defaults to `(a) == (b)`,
+ *    - HMAP_NAME will be inserted inside type- and method-names as:
+ *       . type: struct cod_hmap_<HMAP_NAME>;
+ *       . methods: cod_hmap_<HMAP_NAME>_<method-name>(...)
+ *      Alternatively, HMAP_FULL_NAME will be used as is instead of
+ *      cod_hmap_<HMAP_NAME>.
+ *
+ * 2) #include "codeine/hmap.h"
+ *    Note: it will #undef all of the above on it's own.
+ *
+ *
+ * METHODS:
+ * + Construct/Destroy:
+ *   - hmap_XXX_init(map)                : Initialize map (allocates nothing).
+ *   - hmap_XXX_destroy(map)             : Release memory.
+ *
+ * + Access:
+ *   - hmap_XXX_find(map, key)           : Get pointer to the value, or NULL.
+ *   - hmap_XXX_emplace(map, key, &isnew): Get pointer to the value, inserting
+ *                                         a new entry if the key is missing.
+ *                                         Note: initialisation of the new
+ *                                         value is on user responsibility.
+ *   - hmap_XXX_insert(map, key, val)    : Insert, if there is no such key yet.
+ *                                         Returns 1 if inserted.
+ *   - hmap_XXX_set(map, key, val)       : Insert or replace the value.
+ *   - hmap_XXX_erase(map, key)          : Remove the key. Returns 1 if found.
+ *
+ * + Buffer manipulations:
+ *   - hmap_XXX_reserve(map, n)          : Allocate space to hold n entries
+ *                                         without additional allocations.
+ *
+ * + Iteration:
+ *   - hmap_XXX_next(map, &iter, &key, &val) : Get next entry, returns 0 when
+ *                                         done. Start with `iter = 0`. Both
+ *                                         `key` and `val` are optional.
+ */
+#if !defined(HMAP_KEY) || !defined(HMAP_VAL) || !defined(HMAP_HASH) || \
+    !(defined(HMAP_NAME) || defined(HMAP_FULL_NAME))
+#error Before including "hmap.h" you must define HMAP_KEY, HMAP_VAL, HMAP_HASH and HMAP[_FULL]_NAME
+#endif
+
+#ifndef HMAP_EQ
+#define HMAP_EQ(a, b) ((a) == (b))
+#endif
+
+#define _HMAP_CONCAT(x, y) x##y
+#define _HMAP_CONCAT3(x, y, z) x##y##z
+#define _HMAP_CONCAT4(x, y, z, k) x##y##z##k
+#define _HMAP_APPLY(macro, ...) macro(__VA_ARGS__)
+
+#ifdef HMAP_FULL_NAME
+#define _HMAP_METHOD(method) _HMAP_APPLY(_HMAP_CONCAT3, HMAP_FULL_NAME, _ , method)
+#define _HMAP HMAP_FULL_NAME
+#else
+#define _HMAP_METHOD(method) _HMAP_APPLY(_HMAP_CONCAT4, cod_hmap_, HMAP_NAME, _ , method)
+#define _HMAP _HMAP_APPLY(_HMAP_CONCAT, cod_hmap_, HMAP_NAME)
+#endif
+#define _HMAP_ENTRY _HMAP_METHOD(entry)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _HMAP_COMMON
+#define _HMAP_COMMON
+#define _HMAP_EMPTY ((int8_t)-128)
+#define _HMAP_DELETED ((int8_t)-2)
+#define _HMAP_MINCAP 8
+/* Fibonacci hashing: index is taken from the top bits of the product. */
+#define _HMAP_SCRAMBLE(h) ((uint64_t)(h) * 0x9E3779B97F4A7C15ull)
+#endif
+
+struct _HMAP_ENTRY
+{
+  HMAP_KEY key;
+  HMAP_VAL val;
+};
+
+struct _HMAP
+{
+  int8_t* ctrl;
+  struct _HMAP_ENTRY* entries;
+  size_t size;
+  size_t ntomb;          /* number of deleted slots */
+  size_t cap;
+  unsigned shift;        /* 64 - log2(cap) */
+};
+
+static
+void _HMAP_METHOD(init)(struct _HMAP* map);
+static
+void _HMAP_METHOD(destroy)(struct _HMAP* map);
+static
+void _HMAP_METHOD(reserve)(struct _HMAP* map, size_t n);
+
+static __inline__
+HMAP_VAL* _HMAP_METHOD(find)(const struct _HMAP* map, HMAP_KEY key);
+static __inline__
+HMAP_VAL* _HMAP_METHOD(emplace)(struct _HMAP* map, HMAP_KEY key, int* isnew);
+static __inline__
+int _HMAP_METHOD(insert)(struct _HMAP* map, HMAP_KEY key, HMAP_VAL val);
+static __inline__
+void _HMAP_METHOD(set)(struct _HMAP* map, HMAP_KEY key, HMAP_VAL val);
+static __inline__
+int _HMAP_METHOD(erase)(struct _HMAP* map, HMAP_KEY key);
+static __inline__
+int _HMAP_METHOD(next)(const struct _HMAP* map, size_t* iter, HMAP_KEY* key,
+    HMAP_VAL** val);
+
+
+static
+void _HMAP_METHOD(init)(struct _HMAP* map)
+{
+  map->ctrl = NULL;
+  map->entries = NULL;
+  map->size = 0;
+  map->ntomb = 0;
+  map->cap = 0;
+  map->shift = 64;
+}
+
+static
+void _HMAP_METHOD(destroy)(struct _HMAP* map)
+{ free(map->entries); }
+
+/* Allocate a table of `cap` slots and move all entries there. */
+static
+void _HMAP_METHOD(rehash)(struct _HMAP* map, size_t cap)
+{
+  int8_t* oldctrl = map->ctrl;
+  struct _HMAP_ENTRY* oldentries = map->entries;
+  size_t oldcap = map->cap;
+
+  /* Entries and control bytes share single allocation. */
+  map->entries = malloc((sizeof(struct _HMAP_ENTRY) + 1) * cap);
+  assert(map->entries);
+  map->ctrl = (int8_t*)(map->entries + cap);
+  memset(map->ctrl, _HMAP_EMPTY, cap);
+  map->cap = cap;
+  map->shift = 64 - __builtin_ctzll(cap);
+  map->ntomb = 0;
+
+  for (size_t i = 0; i < oldcap; ++i) {
+    if (oldctrl[i] < 0)
+      continue;
+    uint64_t h = _HMAP_SCRAMBLE(HMAP_HASH(oldentries[i].key));
+    size_t j = h >> map->shift;
+    while (map->ctrl[j] != _HMAP_EMPTY)
+      j = (j + 1) & (cap - 1);
+    map->ctrl[j] = (h >> (map->shift - 7)) & 0x7F;
+    map->entries[j] = oldentries[i];
+  }
+  free(oldentries);
+}
+
+static
+void _HMAP_METHOD(reserve)(struct _HMAP* map, size_t n)
+{
+  /* Load factor (including tombstones) is kept below 3/4. */
+  size_t cap = _HMAP_MINCAP;
+  while (cap * 3 < n * 4)
+    cap <<= 1;
+  if (cap > map->cap)
+    _HMAP_METHOD(rehash)(map, cap);
+}
+
+static __inline__
+size_t _HMAP_METHOD(lookup)(const struct _HMAP* map, HMAP_KEY key)
+{
+  if (map->size == 0)
+    return SIZE_MAX;
+
+  uint64_t h = _HMAP_SCRAMBLE(HMAP_HASH(key));
+  size_t i = h >> map->shift;
+  int8_t tag = (h >> (map->shift - 7)) & 0x7F;
+  for (;; i = (i + 1) & (map->cap - 1)) {
+    int8_t c = map->ctrl[i];
+    if (c == tag && HMAP_EQ(map->entries[i].key, key))
+      return i;
+    if (c == _HMAP_EMPTY)
+      return SIZE_MAX;
+  }
+}
+
+static __inline__
+HMAP_VAL* _HMAP_METHOD(find)(const struct _HMAP* map, HMAP_KEY key)
+{
+  size_t i = _HMAP_METHOD(lookup)(map, key);
+  return i == SIZE_MAX ? NULL : &map->entries[i].val;
+}
+
+static __inline__
+HMAP_VAL* _HMAP_METHOD(emplace)(struct _HMAP* map, HMAP_KEY key, int* isnew)
+{
+  uint64_t h = _HMAP_SCRAMBLE(HMAP_HASH(key));
+  size_t i = 0;
+  size_t ifree = SIZE_MAX;
+  if (map->cap) {
+    int8_t tag = (h >> (map->shift - 7)) & 0x7F;
+    for (i = h >> map->shift;; i = (i + 1) & (map->cap - 1)) {
+      int8_t c = map->ctrl[i];
+      if (c == tag && HMAP_EQ(map->entries[i].key, key)) {
+        *isnew = 0;
+        return &map->entries[i].val;
+      }
+      if (c == _HMAP_DELETED && ifree == SIZE_MAX)
+        ifree = i;
+      if (c == _HMAP_EMPTY)
+        break;
+    }
+  }
+
+  /* The table only grows when a new entry takes an empty slot, so pointers to
+   * existing values survive emplacing of existing keys. */
+  if (ifree != SIZE_MAX) {
+    map->ntomb--;
+  } else if ((map->size + map->ntomb + 1) * 4 > map->cap * 3) {
+    if (map->ntomb > map->size / 2)
+      /* Just drop the tombstones. */
+      _HMAP_METHOD(rehash)(map, map->cap);
+    else
+      _HMAP_METHOD(rehash)(map, map->cap ? map->cap << 1 : _HMAP_MINCAP);
+    /* The key is missing, so it goes into the first empty slot. */
+    for (i = h >> map->shift; map->ctrl[i] != _HMAP_EMPTY;
+         i = (i + 1) & (map->cap - 1));
+    ifree = i;
+  } else {
+    ifree = i;
+  }
+
+  map->ctrl[ifree] = (h >> (map->shift - 7)) & 0x7F;
+  map->entries[ifree].key = key;
+  map->size++;
+  *isnew = 1;
+  return &map->entries[ifree].val;
+}
+
+static __inline__
+int _HMAP_METHOD(insert)(struct _HMAP* map, HMAP_KEY key, HMAP_VAL val)
+{
+  int isnew;
+  HMAP_VAL* slot = _HMAP_METHOD(emplace)(map, key, &isnew);
+  if (isnew)
+    *slot = val;
+  return isnew;
+}
+
+static __inline__
+void _HMAP_METHOD(set)(struct _HMAP* map, HMAP_KEY key, HMAP_VAL val)
+{
+  int isnew;
+  *_HMAP_METHOD(emplace)(map, key, &isnew) = val;
+}
+
+static __inline__
+int _HMAP_METHOD(erase)(struct _HMAP* map, HMAP_KEY key)
+{
+  size_t i = _HMAP_METHOD(lookup)(map, key);
+  if (i == SIZE_MAX)
+    return 0;
+
+  /* No probe sequence passes through the slot followed by an empty one. */
+  if (map->ctrl[(i + 1) & (map->cap - 1)] == _HMAP_EMPTY) {
+    map->ctrl[i] = _HMAP_EMPTY;
+  } else {
+    map->ctrl[i] = _HMAP_DELETED;
+    map->ntomb++;
+  }
+  map->size--;
+  return 1;
+}
+
+static __inline__
+int _HMAP_METHOD(next)(const struct _HMAP* map, size_t* iter, HMAP_KEY* key,
+    HMAP_VAL** val)
+{
+  for (size_t i = *iter; i < map->cap; ++i) {
+    if (map->ctrl[i] >= 0) {
+      if (key) *key = map->entries[i].key;
+      if (val) *val = &map->entries[i].val;
+      *iter = i + 1;
+      return 1;
+    }
+  }
+  *iter = map->cap;
+  return 0;
+}
+
+#undef HMAP_KEY
+#undef HMAP_VAL
+#undef HMAP_HASH
+#undef HMAP_EQ
+#ifdef HMAP_NAME
+#undef HMAP_NAME
+#endif
+#ifdef HMAP_FULL_NAME
+#undef HMAP_FULL_NAME
+#endif
+#undef _HMAP_CONCAT
+#undef _HMAP_CONCAT3
+#undef _HMAP_CONCAT4
+#undef _HMAP_APPLY
+#undef _HMAP_METHOD
+#undef _HMAP
+#undef _HMAP_ENTRY
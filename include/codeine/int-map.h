@@ -0,0 +1,104 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Map from 64-bit integers to pointers.
+ *
+ * Keys are hashed by the map itself (cod_fmix64()), and stored inline in an
+ * open-addressing table with linear probing. Keys and values live in separate
+ * arrays, so that probing touches only the keys; no hash is stored. Key 0
+ * marks empty slots, so the value of key 0 is kept aside. Erasure shifts the
+ * following elements back instead of leaving tombstones.
+ */
+#ifndef COD_INT_MAP_H
+#define COD_INT_MAP_H
+
+#include "codeine/common.h"
+
+#include <stddef.h>
+
+#ifndef COD_INT_MAP_BATCH
+# define COD_INT_MAP_BATCH 16
+#endif
+
+typedef struct {
+  uint64_t *keys;
+  void **vals;
+  size_t size, cap;
+  int has_zero; /* whether key 0 is present */
+  void *zero_val;
+} cod_int_map;
+
+cod_int_map*
+cod_int_map_new(void);
+
+/**
+ * \brief Create a map able to hold `n` elements without growing.
+ */
+cod_int_map*
+cod_int_map_new_with_capacity(size_t n);
+
+void
+cod_int_map_delete(cod_int_map *map, void (*dtor)(void*));
+
+void
+cod_int_map_reserve(cod_int_map *map, size_t n);
+
+/**
+ * \brief Insert (or replace, if `dtor` is given) a value.
+ *
+ * \return 1 if the value was stored, 0 if the key is already there and `dtor`
+ * is NULL.
+ */
+int
+cod_int_map_insert(cod_int_map *map, uint64_t key, void *val,
+    void (*dtor)(void*));
+
+int
+cod_int_map_erase(cod_int_map *map, uint64_t key, void (*dtor)(void*));
+
+/**
+ * \brief Get pointer to the value of the key, or NULL.
+ *
+ * The pointer is invalidated by subsequent insertions and erasures.
+ */
+void**
+cod_int_map_find(const cod_int_map *map, uint64_t key);
+
+/**
+ * \brief Look up `n` keys at once.
+ *
+ * Hashes of a group of `COD_INT_MAP_BATCH` keys are computed and their home
+ * slots prefetched before probing. With AVX2, four keys of the table are
+ * compared per instruction.
+ *
+ * Values are written into `out` (NULL for missing keys).
+ *
+ * \return Number of keys found.
+ */
+size_t
+cod_int_map_find_batch(const cod_int_map *map, const uint64_t *keys, size_t n,
+    void **out);
+
+/**
+ * \brief Get next element, starting with `*iter = 0`.
+ *
+ * \return 0 when there are no more elements.
+ */
+int
+cod_int_map_next(const cod_int_map *map, size_t *iter, uint64_t *key,
+    void **val);
+
+#endif
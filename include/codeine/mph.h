@@ -0,0 +1,118 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Read-only map over a fixed key set, based on a minimal perfect hash function
+ * (PTHash-style).
+ *
+ * Keys are hashed with cod_hash64() and split into buckets of about
+ * `COD_MPH_BUCKET` keys. Each bucket gets a 16-bit pilot chosen so that the
+ * positions of its keys (mixed from their hashes and the pilot) hit free slots
+ * of a table slightly larger than the number of keys; the few positions past
+ * the last key are remapped into the holes. A lookup thus computes one hash, reads one pilot,
+ * and compares the key in exactly one slot. Apart from keys and values, the
+ * structure takes about half a byte per key.
+ *
+ * sources:
+ *   https://arxiv.org/abs/2104.10402 (PTHash)
+ *   http://cmph.sourceforge.net/papers/esa09.pdf (CHD)
+ */
+#ifndef COD_MPH_H
+#define COD_MPH_H
+
+#include "codeine/hash-map.h"
+
+#include <stdio.h>
+
+#ifndef COD_MPH_BUCKET
+# define COD_MPH_BUCKET 4
+#endif
+
+typedef struct {
+  uint64_t seed;
+  size_t size; /* number of keys */
+  size_t tabsize; /* positions computed by the hash (>= size) */
+  size_t nbuckets;
+  uint16_t *pilots;
+  uint32_t *remap; /* slots of positions [size, tabsize) */
+  uint32_t *koff; /* key of slot i is keys[koff[i] .. koff[i+1] - 1) */
+  uint32_t *ids; /* index of the key of slot i in the builder's input */
+  char *keys; /* zero-terminated keys */
+  void **vals;
+} cod_mph;
+
+/**
+ * \brief Build the map from `n` keys.
+ *
+ * `vals` may be NULL, then all values are NULL.
+ *
+ * \return NULL with `errno` set on failure: EEXIST if some key is repeated,
+ * EOVERFLOW if keys take more than 4GB.
+ */
+cod_mph*
+cod_mph_build(const void *const *keys, const size_t *lens, void *const *vals,
+    size_t n);
+
+/**
+ * \brief Build the map from elements of a hash map (with string keys).
+ *
+ * \return NULL with `errno` set on failure (EINVAL for a map with
+ * COD_HASH_MAP_INTKEYS).
+ */
+cod_mph*
+cod_mph_from_hash_map(const cod_hash_map *map);
+
+void
+cod_mph_delete(cod_mph *mph, void (*dtor)(void*));
+
+/**
+ * \brief Get slot of the key, or -1 if it is not there.
+ */
+long
+cod_mph_slot(const cod_mph *mph, const void *key, size_t len);
+
+/**
+ * \brief Get pointer to the value of the key, or NULL.
+ */
+static inline void**
+cod_mph_find(const cod_mph *mph, const void *key, size_t len)
+{
+  long i = cod_mph_slot(mph, key, len);
+  return i < 0 ? NULL : mph->vals + i;
+}
+
+/**
+ * \brief Get key stored in the slot.
+ */
+static inline const char*
+cod_mph_key(const cod_mph *mph, size_t slot)
+{ return mph->keys + mph->koff[slot]; }
+
+/**
+ * \brief Write the map as C source.
+ *
+ * The source defines
+ *
+ *     long <name>_index(const void *key, size_t len);
+ *
+ * returning position of the key in the array passed to cod_mph_build() (or
+ * -1), and has to be linked with this library. Values are not written.
+ *
+ * \return 0 on success, or -1 with `errno` set.
+ */
+int
+cod_mph_emit_c(const cod_mph *mph, FILE *out, const char *name);
+
+#endif
@@ -33,6 +33,43 @@
  * ualloc_ASD_destroy(&alloc);
  * ```
  *
+ * Bulk methods:
+ *  - ualloc_XXX_alloc_n(ua, out, n): allocate `n` cells; runs of never used
+ *    cells are carved from a pool at once.
+ *  - ualloc_XXX_free_n(ua, ptrs, n): free `n` cells; consecutive cells of the
+ *    same pool are linked into a chain and spliced into its free list in one
+ *    step (so it pays off when `ptrs` come from alloc_n()).
+ *  - ualloc_XXX_reset(ua): drop all cells at once, keeping the current and
+ *    spare pools mapped.
+ *
+ * Pools:
+ * Pools are mapped with mmap, aligned to their size (UALLOC_POOL_SIZE cells
+ * rounded up to a power of two), and start with a header. So the pool of a cell
+ * is found from its address. Every pool has its own free list and count of
+ * live cells. Cells come from the current pool; when it is exhausted, the next
+ * one is taken from the list of pools having free cells. A pool left with no
+ * live cells is unmapped, unless there are less than UALLOC_SPARE_POOLS empty
+ * pools kept around (so that a pool is not mapped and unmapped over and over
+ * at the boundary).
+ *
+ * Options (define before inclusion):
+ *  - UALLOC_SPARE_POOLS: number of empty pools to keep (default 1).
+ *  - UALLOC_CELL_ALIGN: alignment of cells, e.g. 64 to give every cell its
+ *    own cache line.
+ *  - UALLOC_HUGEPAGE: advise transparent huge pages for pools (MADV_HUGEPAGE).
+ *  - UALLOC_HUGETLB: map pools from the huge page pool (MAP_HUGETLB), falling
+ *    back to normal pages if it fails. Pools have to be multiple of 2MB.
+ *
+ * Multi-threaded mode:
+ * With UALLOC_MT defined, the same methods may be called from any thread.
+ * Every thread allocates from its own cache of pools, and frees of cells from
+ * the pools of this cache go to their free lists, with no synchronization.
+ * A cell freed by another thread is pushed (with CAS) onto the remote-free list
+ * of the cache owning its pool (the pool header points to it); the owner takes
+ * the whole list at once when its current pool runs out. A cache of an exited
+ * thread is adopted by the next thread that starts allocating. Requires
+ * pthreads.
+ *
  * Note:
  * Requires my "vector.h".
  * You can get it from <https://gist.github.com/pidhii/91a86b1c58816d0fa010083967666ed6>.
@@ -42,6 +79,10 @@
 #define UALLOC_POOL_SIZE 0x4000
 #endif
 
+#ifndef UALLOC_SPARE_POOLS
+#define UALLOC_SPARE_POOLS 1
+#endif
+
 #define _UALLOC_CONCAT(x, y) x##y
 #define _UALLOC_CONCAT3(x, y, z) x##y##z
 #define _UALLOC_CONCAT4(x, y, z, k) x##y##z##k
@@ -49,94 +90,564 @@
 
 #define _UALLOC_CELL union _UALLOC_APPLY(_UALLOC_CONCAT, cod_ualloc_cell_, UALLOC_NAME)
 #define _UALLOC_POOL struct _UALLOC_APPLY(_UALLOC_CONCAT, cod_ualloc_pool_, UALLOC_NAME)
+#define _UALLOC_HEAP struct _UALLOC_APPLY(_UALLOC_CONCAT, cod_ualloc_heap_, UALLOC_NAME)
 #define _UALLOC struct _UALLOC_APPLY(_UALLOC_CONCAT, cod_ualloc_, UALLOC_NAME)
 #define _UALLOC_METHOD(method) _UALLOC_APPLY(_UALLOC_CONCAT4, cod_ualloc_, UALLOC_NAME, _ , method)
 
+#ifdef UALLOC_MT
+#define _UALLOC_TCACHE struct _UALLOC_APPLY(_UALLOC_CONCAT, cod_ualloc_tcache_, UALLOC_NAME)
+#endif
+
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include "codeine/common.h"
+#ifdef UALLOC_MT
+# include <pthread.h>
+#endif
 
 _UALLOC_CELL
 {
   UALLOC_TYPE data;
   _UALLOC_CELL* next_free;
-};
+}
+#ifdef UALLOC_CELL_ALIGN
+__attribute__((aligned(UALLOC_CELL_ALIGN)))
+#endif
+;
+
+#ifdef UALLOC_MT
+_UALLOC_TCACHE;
+#endif
 
+/* Header at the start of a pool. */
 _UALLOC_POOL
 {
-  _UALLOC_CELL* pool;
-  size_t size;             /* Number of currently available free cells. */
+#ifdef UALLOC_MT
+  _UALLOC_TCACHE* owner;
+#endif
+  _UALLOC_CELL* free_cell; /* Free list of this pool. */
+  size_t size;             /* Number of cells handed out from the pool so far. */
+  size_t live;             /* Number of allocated cells. */
+  size_t index;            /* Position in the vector of pools. */
+  _UALLOC_POOL* prev;      /* Links in the list of pools with free cells. */
+  _UALLOC_POOL* next;
+  int partial;             /* Whether the pool is in this list. */
 };
 
 
 #define _UALLOC_POOLS_VEC _UALLOC_APPLY(_UALLOC_CONCAT3, cod_ualloc_pools, _, UALLOC_NAME)
 #define GVEC_FULL_NAME _UALLOC_POOLS_VEC
-#define GVEC_TYPE _UALLOC_POOL
+#define GVEC_TYPE _UALLOC_POOL*
 #include "codeine/gvec.h"
 
-_UALLOC
+/* Pools of a single thread. */
+_UALLOC_HEAP
 {
-  size_t npools;
   struct _UALLOC_POOLS_VEC pools;
   _UALLOC_POOL* curpool;
-  _UALLOC_CELL* free_cell; /* Pointer to some free cell, or NULL. */
+  _UALLOC_POOL* partial;   /* Pools (other than current) with free cells. */
+  size_t nempty;           /* Number of pools without live cells. */
+#ifdef UALLOC_MT
+  _UALLOC_TCACHE* owner;
+#endif
 };
 
+#ifdef UALLOC_MT
+_UALLOC;
+
+_UALLOC_TCACHE
+{
+  _UALLOC_HEAP heap;
+  _UALLOC_CELL* remote_free; /* Cells freed by other threads (atomic). */
+  _UALLOC* ua;
+  _UALLOC_TCACHE* next; /* In the list of all caches. */
+  int orphan; /* Owner thread has exited. */
+};
+
+_UALLOC
+{
+  pthread_key_t key;
+  pthread_mutex_t mutex;
+  _UALLOC_TCACHE* caches;
+};
+#else
+_UALLOC
+{
+  _UALLOC_HEAP heap;
+};
+#endif
+
+/* Pool size in bytes (also its alignment), at least a page. */
+static __inline__
+size_t _UALLOC_METHOD(pool_bytes)(void)
+{
+  size_t bytes = cod_rndup2_u64(UALLOC_POOL_SIZE * sizeof(_UALLOC_CELL));
+  return bytes < 0x1000 ? 0x1000 : bytes;
+}
+
+static __inline__
+size_t _UALLOC_METHOD(pool_cells)(void)
+{ return _UALLOC_METHOD(pool_bytes)() / sizeof(_UALLOC_CELL); }
+
+/* Number of cells taken by the header. */
+static __inline__
+size_t _UALLOC_METHOD(header_cells)(void)
+{ return (sizeof(_UALLOC_POOL) + sizeof(_UALLOC_CELL) - 1) / sizeof(_UALLOC_CELL); }
+
+static __inline__
+_UALLOC_CELL* _UALLOC_METHOD(cells)(_UALLOC_POOL* pool)
+{ return (_UALLOC_CELL*)pool; }
+
+static __inline__
+_UALLOC_POOL* _UALLOC_METHOD(pool_of)(void* ptr)
+{
+  uintptr_t mask = _UALLOC_METHOD(pool_bytes)() - 1;
+  return (void*)((uintptr_t)ptr & ~mask);
+}
+
+/* Map `bytes` aligned to `bytes`: map twice as much and trim the excess. */
+static
+void* _UALLOC_METHOD(map_pool)(size_t bytes)
+{
+  const int prot = PROT_READ | PROT_WRITE;
+  char *p = MAP_FAILED;
+#if defined(UALLOC_HUGETLB) && defined(MAP_HUGETLB)
+  if (bytes % (2 << 20) == 0)
+    p = mmap(NULL, 2 * bytes, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+        -1, 0);
+#endif
+  if (p == MAP_FAILED)
+    p = mmap(NULL, 2 * bytes, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(p != MAP_FAILED);
+
+  char *aligned = (char*)(((uintptr_t)p + bytes - 1) & ~(uintptr_t)(bytes - 1));
+  if (aligned > p)
+    munmap(p, aligned - p);
+  if (aligned + bytes < p + 2 * bytes)
+    munmap(aligned + bytes, p + 2 * bytes - (aligned + bytes));
+#if defined(UALLOC_HUGEPAGE) && defined(MADV_HUGEPAGE)
+  madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+  return aligned;
+}
+
+static
+_UALLOC_POOL* _UALLOC_METHOD(new_pool)(_UALLOC_HEAP* heap)
+{
+  _UALLOC_POOL* pool = _UALLOC_METHOD(map_pool)(_UALLOC_METHOD(pool_bytes)());
+#ifdef UALLOC_MT
+  pool->owner = heap->owner;
+#endif
+  pool->free_cell = NULL;
+  pool->size = _UALLOC_METHOD(header_cells)();
+  pool->live = 0;
+  pool->index = heap->pools.size;
+  pool->prev = pool->next = NULL;
+  pool->partial = 0;
+  *_UALLOC_APPLY(_UALLOC_CONCAT, _UALLOC_POOLS_VEC, _push_back)(&heap->pools) = pool;
+  heap->nempty += 1;
+  return pool;
+}
+
+static __inline__
+void _UALLOC_METHOD(link_partial)(_UALLOC_HEAP* heap, _UALLOC_POOL* pool)
+{
+  pool->prev = NULL;
+  pool->next = heap->partial;
+  if (heap->partial)
+    heap->partial->prev = pool;
+  heap->partial = pool;
+  pool->partial = 1;
+}
+
 static __inline__
-void _UALLOC_METHOD(init_pool)(_UALLOC_POOL* pool)
+void _UALLOC_METHOD(unlink_partial)(_UALLOC_HEAP* heap, _UALLOC_POOL* pool)
 {
-  pool->pool = malloc(UALLOC_POOL_SIZE * sizeof(_UALLOC_CELL));
-  assert(pool->pool);
-  pool->size = 0;
+  if (pool->prev)
+    pool->prev->next = pool->next;
+  else
+    heap->partial = pool->next;
+  if (pool->next)
+    pool->next->prev = pool->prev;
+  pool->partial = 0;
 }
 
 static
-void _UALLOC_METHOD(destroy_pool)(_UALLOC_POOL* pool)
-{ free(pool->pool); }
+void _UALLOC_METHOD(release_pool)(_UALLOC_HEAP* heap, _UALLOC_POOL* pool)
+{
+  if (pool->partial)
+    _UALLOC_METHOD(unlink_partial)(heap, pool);
+  /* swap with the last one */
+  _UALLOC_POOL* last = heap->pools.data[heap->pools.size - 1];
+  heap->pools.data[pool->index] = last;
+  last->index = pool->index;
+  _UALLOC_APPLY(_UALLOC_CONCAT, _UALLOC_POOLS_VEC, _pop_back)(&heap->pools);
+  munmap(pool, _UALLOC_METHOD(pool_bytes)());
+}
+
+static
+void _UALLOC_METHOD(heap_init)(_UALLOC_HEAP* heap)
+{
+  _UALLOC_APPLY(_UALLOC_CONCAT, _UALLOC_POOLS_VEC, _init)(&heap->pools);
+  heap->partial = NULL;
+  heap->nempty = 0;
+  heap->curpool = _UALLOC_METHOD(new_pool)(heap);
+}
+
+static
+void _UALLOC_METHOD(heap_destroy)(_UALLOC_HEAP* heap)
+{
+  size_t i;
+  for (i = 0; i < heap->pools.size; ++i)
+    munmap(heap->pools.data[i], _UALLOC_METHOD(pool_bytes)());
+  _UALLOC_APPLY(_UALLOC_CONCAT, _UALLOC_POOLS_VEC, _destroy) (&heap->pools);
+}
+
+/* Allocate from the current pool, or return NULL if it is exhausted. */
+static __inline__
+UALLOC_TYPE* _UALLOC_METHOD(heap_alloc_fast)(_UALLOC_HEAP* heap)
+{
+  _UALLOC_POOL* pool = heap->curpool;
+  _UALLOC_CELL *tmp;
+  if ((tmp = pool->free_cell))
+    pool->free_cell = tmp->next_free;
+  else if (pool->size < _UALLOC_METHOD(pool_cells)())
+    tmp = _UALLOC_METHOD(cells)(pool) + pool->size++;
+  else
+    return NULL;
+
+  if (pool->live++ == 0)
+    heap->nempty -= 1;
+  return (void*)tmp;
+}
+
+/* Switch to a pool with free cells (or a new one). */
+static
+void _UALLOC_METHOD(next_pool)(_UALLOC_HEAP* heap)
+{
+  _UALLOC_POOL* pool = heap->partial;
+  if (pool)
+    _UALLOC_METHOD(unlink_partial)(heap, pool);
+  else
+    pool = _UALLOC_METHOD(new_pool)(heap);
+  heap->curpool = pool;
+}
+
+static
+UALLOC_TYPE* _UALLOC_METHOD(heap_alloc_slow)(_UALLOC_HEAP* heap)
+{
+  _UALLOC_METHOD(next_pool)(heap);
+  return _UALLOC_METHOD(heap_alloc_fast)(heap);
+}
+
+static
+void _UALLOC_METHOD(heap_alloc_n)(_UALLOC_HEAP* heap, UALLOC_TYPE** out,
+    size_t n)
+{
+  const size_t ncells = _UALLOC_METHOD(pool_cells)();
+  size_t i = 0;
+  for (;;) {
+    _UALLOC_POOL* pool = heap->curpool;
+    const size_t start = i;
+    _UALLOC_CELL *tmp;
+    while (i < n && (tmp = pool->free_cell)) {
+      pool->free_cell = tmp->next_free;
+      out[i++] = (void*)tmp;
+    }
+    /* a run of never used cells */
+    size_t run = ncells - pool->size;
+    if (run > n - i)
+      run = n - i;
+    tmp = _UALLOC_METHOD(cells)(pool) + pool->size;
+    pool->size += run;
+    while (run--)
+      out[i++] = (void*)tmp++;
+
+    if (i > start) {
+      if (pool->live == 0)
+        heap->nempty -= 1;
+      pool->live += i - start;
+    }
+    if (i == n)
+      return;
+    _UALLOC_METHOD(next_pool)(heap);
+  }
+}
+
+/* Return a chain of `n` cells of the pool, linked from `first` to `last`. */
+static __inline__
+void _UALLOC_METHOD(heap_free_chain)(_UALLOC_HEAP* heap, _UALLOC_POOL* pool,
+    _UALLOC_CELL* first, _UALLOC_CELL* last, size_t n)
+{
+  last->next_free = pool->free_cell;
+  pool->free_cell = first;
+
+  if ((pool->live -= n) == 0) {
+    if (pool != heap->curpool && heap->nempty >= UALLOC_SPARE_POOLS) {
+      _UALLOC_METHOD(release_pool)(heap, pool);
+      return;
+    }
+    heap->nempty += 1;
+  }
+
+  if (pool != heap->curpool && !pool->partial)
+    _UALLOC_METHOD(link_partial)(heap, pool);
+}
+
+static __inline__
+void _UALLOC_METHOD(heap_free)(_UALLOC_HEAP* heap, _UALLOC_POOL* pool,
+    _UALLOC_CELL* cell)
+{ _UALLOC_METHOD(heap_free_chain)(heap, pool, cell, cell, 1); }
+
+/* Link cells starting at ptrs[i] while they belong to the same pool; returns
+ * index past the run. */
+static __inline__
+size_t _UALLOC_METHOD(chain_run)(UALLOC_TYPE* const* ptrs, size_t i, size_t n,
+    _UALLOC_CELL** last)
+{
+  _UALLOC_POOL* pool = _UALLOC_METHOD(pool_of)(ptrs[i]);
+  _UALLOC_CELL* cell = (void*)ptrs[i];
+  for (++i; i < n && _UALLOC_METHOD(pool_of)(ptrs[i]) == pool; ++i) {
+    cell->next_free = (void*)ptrs[i];
+    cell = (void*)ptrs[i];
+  }
+  *last = cell;
+  return i;
+}
+
+/* Drop all cells; keep the current pool and up to UALLOC_SPARE_POOLS others. */
+static
+void _UALLOC_METHOD(heap_reset)(_UALLOC_HEAP* heap)
+{
+  size_t i = 0, nkept = 0;
+  heap->partial = NULL;
+  heap->nempty = 0;
+  while (i < heap->pools.size) {
+    _UALLOC_POOL* pool = heap->pools.data[i];
+    pool->partial = 0;
+    if (pool != heap->curpool && nkept == UALLOC_SPARE_POOLS) {
+      /* the last pool is moved into slot i */
+      _UALLOC_METHOD(release_pool)(heap, pool);
+      continue;
+    }
+    pool->free_cell = NULL;
+    pool->size = _UALLOC_METHOD(header_cells)();
+    pool->live = 0;
+    heap->nempty += 1;
+    if (pool != heap->curpool) {
+      _UALLOC_METHOD(link_partial)(heap, pool);
+      nkept += 1;
+    }
+    i += 1;
+  }
+}
+
+#ifdef UALLOC_MT
+static
+void _UALLOC_METHOD(orphan_cache)(void* ptr)
+{
+  _UALLOC_TCACHE* tc = ptr;
+  pthread_mutex_lock(&tc->ua->mutex);
+  tc->orphan = 1;
+  pthread_mutex_unlock(&tc->ua->mutex);
+}
+
+/* Bind a cache to the calling thread: adopt an orphaned one, or create new. */
+static
+_UALLOC_TCACHE* _UALLOC_METHOD(attach_cache)(_UALLOC* ua)
+{
+  _UALLOC_TCACHE* tc;
+  pthread_mutex_lock(&ua->mutex);
+  for (tc = ua->caches; tc; tc = tc->next) {
+    if (tc->orphan)
+      break;
+  }
+  if (tc) {
+    tc->orphan = 0;
+  } else {
+    tc = malloc(sizeof(_UALLOC_TCACHE));
+    assert(tc);
+    tc->heap.owner = tc;
+    _UALLOC_METHOD(heap_init)(&tc->heap);
+    tc->remote_free = NULL;
+    tc->ua = ua;
+    tc->orphan = 0;
+    tc->next = ua->caches;
+    ua->caches = tc;
+  }
+  pthread_mutex_unlock(&ua->mutex);
+  pthread_setspecific(ua->key, tc);
+  return tc;
+}
+
+static __inline__
+_UALLOC_TCACHE* _UALLOC_METHOD(cache)(_UALLOC* ua)
+{
+  _UALLOC_TCACHE* tc = pthread_getspecific(ua->key);
+  if (__builtin_expect(tc == NULL, 0))
+    tc = _UALLOC_METHOD(attach_cache)(ua);
+  return tc;
+}
+
+/* Multiple producers, single consumer which takes the whole list: no ABA. */
+static __inline__
+void _UALLOC_METHOD(push_remote)(_UALLOC_TCACHE* owner, _UALLOC_CELL* first,
+    _UALLOC_CELL* last)
+{
+  last->next_free = __atomic_load_n(&owner->remote_free, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&owner->remote_free, &last->next_free,
+        first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Move cells freed by other threads to their pools. */
+static
+void _UALLOC_METHOD(reclaim_remote)(_UALLOC_TCACHE* tc)
+{
+  _UALLOC_CELL *cell, *next;
+  if (__atomic_load_n(&tc->remote_free, __ATOMIC_RELAXED) == NULL)
+    return;
+  cell = __atomic_exchange_n(&tc->remote_free, NULL, __ATOMIC_ACQUIRE);
+  for (; cell; cell = next) {
+    next = cell->next_free;
+    _UALLOC_METHOD(heap_free)(&tc->heap, _UALLOC_METHOD(pool_of)(cell), cell);
+  }
+}
 
 void _UALLOC_METHOD(init)(_UALLOC* ua)
 {
-  _UALLOC_APPLY(_UALLOC_CONCAT, _UALLOC_POOLS_VEC, _init)(&ua->pools);
-  ua->curpool =
-    _UALLOC_APPLY(_UALLOC_CONCAT, _UALLOC_POOLS_VEC, _push_back)(&ua->pools);
-  _UALLOC_METHOD(init_pool)(ua->curpool);
+  int err = pthread_key_create(&ua->key, _UALLOC_METHOD(orphan_cache));
+  assert(err == 0);
+  (void)err;
+  pthread_mutex_init(&ua->mutex, NULL);
+  ua->caches = NULL;
 }
 
+/* Must not race with other methods. */
 void _UALLOC_METHOD(destroy)(_UALLOC* ua)
 {
-  size_t i;
-  for (i = 0; i < ua->pools.size; ++i)
-    _UALLOC_METHOD(destroy_pool)(&ua->pools.data[i]);
-  _UALLOC_APPLY(_UALLOC_CONCAT, _UALLOC_POOLS_VEC, _destroy) (&ua->pools);
+  _UALLOC_TCACHE *tc, *next;
+  for (tc = ua->caches; tc; tc = next) {
+    next = tc->next;
+    _UALLOC_METHOD(heap_destroy)(&tc->heap);
+    free(tc);
+  }
+  pthread_key_delete(ua->key);
+  pthread_mutex_destroy(&ua->mutex);
 }
 
 static __inline__
 UALLOC_TYPE* _UALLOC_METHOD(alloc)(_UALLOC* ua)
 {
-  _UALLOC_CELL *tmp;
-  if ((tmp = ua->free_cell)) {
-    ua->free_cell = tmp->next_free;
-    return (void*)tmp;
+  _UALLOC_TCACHE* tc = _UALLOC_METHOD(cache)(ua);
+  UALLOC_TYPE* ptr = _UALLOC_METHOD(heap_alloc_fast)(&tc->heap);
+  if (__builtin_expect(ptr != NULL, 1))
+    return ptr;
+
+  _UALLOC_METHOD(reclaim_remote)(tc);
+  if ((ptr = _UALLOC_METHOD(heap_alloc_fast)(&tc->heap)))
+    return ptr;
+  return _UALLOC_METHOD(heap_alloc_slow)(&tc->heap);
+}
+
+static __inline__
+int _UALLOC_METHOD(free)(_UALLOC* ua, UALLOC_TYPE* ptr)
+{
+  _UALLOC_CELL* cell = (void*)ptr;
+  _UALLOC_POOL* pool = _UALLOC_METHOD(pool_of)(ptr);
+  _UALLOC_TCACHE* owner = pool->owner;
+  if (owner == pthread_getspecific(ua->key)) {
+    _UALLOC_METHOD(heap_free)(&owner->heap, pool, cell);
+    return 0;
+  }
+
+  _UALLOC_METHOD(push_remote)(owner, cell, cell);
+  return 0;
+}
+
+static __inline__
+void _UALLOC_METHOD(alloc_n)(_UALLOC* ua, UALLOC_TYPE** out, size_t n)
+{
+  _UALLOC_TCACHE* tc = _UALLOC_METHOD(cache)(ua);
+  _UALLOC_METHOD(reclaim_remote)(tc);
+  _UALLOC_METHOD(heap_alloc_n)(&tc->heap, out, n);
+}
+
+static __inline__
+int _UALLOC_METHOD(free_n)(_UALLOC* ua, UALLOC_TYPE* const* ptrs, size_t n)
+{
+  _UALLOC_TCACHE* self = pthread_getspecific(ua->key);
+  size_t i = 0, j;
+  while (i < n) {
+    _UALLOC_POOL* pool = _UALLOC_METHOD(pool_of)(ptrs[i]);
+    _UALLOC_CELL *first = (void*)ptrs[i], *last;
+    j = _UALLOC_METHOD(chain_run)(ptrs, i, n, &last);
+    if (pool->owner == self)
+      _UALLOC_METHOD(heap_free_chain)(&self->heap, pool, first, last, j - i);
+    else
+      _UALLOC_METHOD(push_remote)(pool->owner, first, last);
+    i = j;
   }
+  return 0;
+}
 
-  if (ua->curpool->size == UALLOC_POOL_SIZE) {
-    /* allocate new pool */
-    ua->curpool =
-      _UALLOC_APPLY(_UALLOC_CONCAT, _UALLOC_POOLS_VEC, _push_back)(&ua->pools);
-    _UALLOC_METHOD(init_pool)(ua->curpool);
+/* Must not race with other methods. */
+void _UALLOC_METHOD(reset)(_UALLOC* ua)
+{
+  _UALLOC_TCACHE* tc;
+  for (tc = ua->caches; tc; tc = tc->next) {
+    tc->remote_free = NULL;
+    _UALLOC_METHOD(heap_reset)(&tc->heap);
   }
+}
+#else
+void _UALLOC_METHOD(init)(_UALLOC* ua)
+{ _UALLOC_METHOD(heap_init)(&ua->heap); }
+
+void _UALLOC_METHOD(destroy)(_UALLOC* ua)
+{ _UALLOC_METHOD(heap_destroy)(&ua->heap); }
 
-  return (void*)(ua->curpool->pool + ua->curpool->size++);
+static __inline__
+UALLOC_TYPE* _UALLOC_METHOD(alloc)(_UALLOC* ua)
+{
+  UALLOC_TYPE* ptr = _UALLOC_METHOD(heap_alloc_fast)(&ua->heap);
+  if (__builtin_expect(ptr != NULL, 1))
+    return ptr;
+  return _UALLOC_METHOD(heap_alloc_slow)(&ua->heap);
 }
 
 static __inline__
 int _UALLOC_METHOD(free)(_UALLOC* ua, UALLOC_TYPE* ptr)
 {
-  ((_UALLOC_CELL*)ptr)->next_free = ua->free_cell;
-  ua->free_cell = (void*)ptr;
+  _UALLOC_METHOD(heap_free)(&ua->heap, _UALLOC_METHOD(pool_of)(ptr),
+      (_UALLOC_CELL*)ptr);
+  return 0;
+}
+
+static __inline__
+void _UALLOC_METHOD(alloc_n)(_UALLOC* ua, UALLOC_TYPE** out, size_t n)
+{ _UALLOC_METHOD(heap_alloc_n)(&ua->heap, out, n); }
+
+static __inline__
+int _UALLOC_METHOD(free_n)(_UALLOC* ua, UALLOC_TYPE* const* ptrs, size_t n)
+{
+  size_t i = 0, j;
+  while (i < n) {
+    _UALLOC_CELL *first = (void*)ptrs[i], *last;
+    j = _UALLOC_METHOD(chain_run)(ptrs, i, n, &last);
+    _UALLOC_METHOD(heap_free_chain)(&ua->heap, _UALLOC_METHOD(pool_of)(first),
+        first, last, j - i);
+    i = j;
+  }
   return 0;
 }
 
+void _UALLOC_METHOD(reset)(_UALLOC* ua)
+{ _UALLOC_METHOD(heap_reset)(&ua->heap); }
+#endif /* UALLOC_MT */
+
 #undef _UALLOC_CONCAT
 #undef _UALLOC_CONCAT3
 #undef _UALLOC_CONCAT4
@@ -144,9 +655,16 @@ int _UALLOC_METHOD(free)(_UALLOC* ua, UALLOC_TYPE* ptr)
 
 #undef _UALLOC_CELL
 #undef _UALLOC_POOL
+#undef _UALLOC_HEAP
 #undef _UALLOC
 #undef _UALLOC_METHOD
+#undef _UALLOC_TCACHE
 
 #undef UALLOC_POOL_SIZE
+#undef UALLOC_SPARE_POOLS
+#undef UALLOC_CELL_ALIGN
+#undef UALLOC_HUGEPAGE
+#undef UALLOC_HUGETLB
 #undef UALLOC_TYPE
 #undef UALLOC_NAME
+#undef UALLOC_MT
@@ -37,47 +37,63 @@ extern "C" {
     (vec).data = NULL;    \
   } while (0)
 
-#define cod_vec_init_with_cap(vec, c)                        \
-  do {                                                       \
-    (vec).cap = (c);                                         \
-    if ((vec).cap == 0)                                      \
-      (vec).cap = 0x10;                                      \
-    (vec).len = 0;                                           \
-    (vec).data = cod_malloc(cod_vec_value_size(vec) * 0x10); \
+/*
+ * Macros with the `_with` suffix take memory from the given allocator (see
+ * common.h), which may be NULL; a vector must be used with the same allocator
+ * throughout its life. Plain ones use cod_malloc() & co.
+ */
+#define cod_vec_init_cap_with(vec, a, c)                                   \
+  do {                                                                     \
+    (vec).cap = (c);                                                       \
+    if ((vec).cap == 0)                                                    \
+      (vec).cap = 0x10;                                                    \
+    (vec).len = 0;                                                         \
+    (vec).data = cod_alloc_with((a), cod_vec_value_size(vec) * (vec).cap); \
   } while (0)
 
-#define cod_vec_destroy(vec) \
-  do {                       \
-    if ((vec).data)          \
-      cod_free((vec).data);  \
-    (vec).data = NULL;       \
-    (vec).len = 0;           \
-    (vec).cap = 0;           \
+#define cod_vec_init_with_cap(vec, c) cod_vec_init_cap_with(vec, NULL, c)
+
+#define cod_vec_destroy_with(vec, a)  \
+  do {                                \
+    if ((vec).data)                   \
+      cod_free_with((a), (vec).data); \
+    (vec).data = NULL;                \
+    (vec).len = 0;                    \
+    (vec).cap = 0;                    \
   } while (0)
 
-#define cod_vec_reserve1(vec)                                                    \
-  do {                                                                           \
-    if (cod_unlikely((vec).len == (vec).cap)) {                                  \
-      if (cod_likely((vec).cap))                                                 \
-        (vec).cap <<= 1;                                                         \
-      else                                                                       \
-        (vec).cap = 0x10;                                                        \
-      (vec).data = cod_realloc((vec).data, cod_vec_value_size(vec) * (vec).cap); \
-    }                                                                            \
+#define cod_vec_destroy(vec) cod_vec_destroy_with(vec, NULL)
+
+#define cod_vec_reserve1_with(vec, a)                \
+  do {                                               \
+    if (cod_unlikely((vec).len == (vec).cap)) {      \
+      if (cod_likely((vec).cap))                     \
+        (vec).cap <<= 1;                             \
+      else                                           \
+        (vec).cap = 0x10;                            \
+      (vec).data = cod_realloc_with((a), (vec).data, \
+          cod_vec_value_size(vec) * (vec).cap);      \
+    }                                                \
   } while (0)
 
-#define cod_vec_push(vec, x...)       \
-  do {                             \
-    cod_vec_reserve1(vec);         \
-    (vec).data[(vec).len++] = (x); \
+#define cod_vec_reserve1(vec) cod_vec_reserve1_with(vec, NULL)
+
+#define cod_vec_push_with(vec, a, x...) \
+  do {                                  \
+    cod_vec_reserve1_with(vec, a);      \
+    (vec).data[(vec).len++] = (x);      \
   } while (0)
 
-#define cod_vec_emplace(vec, ctor...)                         \
+#define cod_vec_push(vec, x...) cod_vec_push_with(vec, NULL, x)
+
+#define cod_vec_emplace_with(vec, a, ctor...)                 \
   do {                                                        \
-    cod_vec_reserve1(vec);                                    \
+    cod_vec_reserve1_with(vec, a);                            \
     (vec).data[(vec).len++] = (cod_vec_value_type(vec)) ctor; \
   } while (0)
 
+#define cod_vec_emplace(vec, ctor...) cod_vec_emplace_with(vec, NULL, ctor)
+
 #define cod_vec_pop(vec) ((vec).data[--(vec).len])
 
 #define cod_vec_last(vec) ((vec).data[(vec).len - 1])
@@ -99,12 +115,12 @@ extern "C" {
     }                                                            \
   } while (0)
 
-#define cod_vec_insert(vec, x, k)                     \
+#define cod_vec_insert_with(vec, a, x, k)             \
   do {                                                \
     if (k == (vec).len) {                             \
-      cod_vec_push((vec), x);                         \
+      cod_vec_push_with((vec), a, x);                 \
     } else {                                          \
-      cod_vec_reserve1(vec);                          \
+      cod_vec_reserve1_with(vec, a);                  \
       memmove((vec).data + k + 1, (vec).data + k,     \
           cod_vec_value_size(vec) * ((vec).len - k)); \
       (vec).data[k] = x;                              \
@@ -112,29 +128,39 @@ extern "C" {
     }                                                 \
   } while (0)
 
-#define cod_vec_erase(vec, k)                       \
-  do {                                              \
-    memmove((vec).data + k, (vec).data + k + 1,     \
-        cod_vec_value_size(vec) * ((vec).len - k)); \
-    (vec).len -= 1;                                 \
+#define cod_vec_insert(vec, x, k) cod_vec_insert_with(vec, NULL, x, k)
+
+#define cod_vec_erase(vec, k)                             \
+  do {                                                    \
+    memmove((vec).data + (k), (vec).data + (k) + 1,       \
+        cod_vec_value_size(vec) * ((vec).len - (k) - 1)); \
+    (vec).len -= 1;                                       \
   } while (0)
 
-#define cod_vec_append(vec, begin, end)                                    \
+#define cod_vec_append_with(vec, a, begin, end)                            \
   do {                                                                     \
     for (const cod_vec_value_type(vec) *iter = begin; iter != end; ++iter) \
-      cod_vec_push(vec, *iter);                                            \
+      cod_vec_push_with(vec, a, *iter);                                    \
   } while (0)
 
+#define cod_vec_append(vec, begin, end) \
+  cod_vec_append_with(vec, NULL, begin, end)
+
 
 struct cod_strvec {
   char **data;
   size_t size;
   size_t cap;
+  const cod_allocator *allocator;
 };
 
 void
 cod_strvec_init(struct cod_strvec *vec);
 
+void
+cod_strvec_init_with_allocator(struct cod_strvec *vec,
+    const cod_allocator *allocator);
+
 void
 cod_strvec_destroy(struct cod_strvec *vec);
 
@@ -158,11 +184,16 @@ struct cod_intvec {
   intmax_t *data;
   size_t size;
   size_t cap;
+  const cod_allocator *allocator;
 };
 
 void
 cod_intvec_init(struct cod_intvec *vec);
 
+void
+cod_intvec_init_with_allocator(struct cod_intvec *vec,
+    const cod_allocator *allocator);
+
 void
 cod_intvec_destroy(struct cod_intvec *vec);
 
@@ -186,11 +217,16 @@ struct cod_ptrvec {
   void **data;
   size_t size;
   size_t cap;
+  const cod_allocator *allocator;
 };
 
 void
 cod_ptrvec_init(struct cod_ptrvec *vec);
 
+void
+cod_ptrvec_init_with_allocator(struct cod_ptrvec *vec,
+    const cod_allocator *allocator);
+
 void
 cod_ptrvec_destroy(struct cod_ptrvec *vec, void (*free)(void*));
 
@@ -0,0 +1,229 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "codeine/arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+struct cod_arena_chunk {
+  cod_arena_chunk *next;
+  size_t size;
+  _Alignas(COD_ARENA_ALIGN) char data[];
+};
+
+static __thread cod_arena *current;
+
+void
+cod_arena_init(cod_arena *arena, size_t chunk_size)
+{
+  arena->head = arena->cur = NULL;
+  arena->ptr = arena->end = arena->last = NULL;
+  arena->chunk_size = chunk_size ? chunk_size : COD_ARENA_CHUNK;
+}
+
+void
+cod_arena_destroy(cod_arena *arena)
+{
+  cod_arena_chunk *next;
+  for (cod_arena_chunk *c = arena->head; c; c = next)
+  {
+    next = c->next;
+    free(c);
+  }
+  cod_arena_init(arena, arena->chunk_size);
+}
+
+static void
+enter_chunk(cod_arena *arena, cod_arena_chunk *c)
+{
+  arena->cur = c;
+  arena->ptr = c->data;
+  arena->end = c->data + c->size;
+}
+
+void*
+cod_arena_alloc_slow(cod_arena *arena, size_t size, size_t align)
+{
+  const size_t need = size + (align > COD_ARENA_ALIGN ? align : 0);
+
+  /* Chunks following the current one are left from reset/rewind; a new chunk
+   * is inserted before the next one if that is too small. */
+  cod_arena_chunk *next = arena->cur ? arena->cur->next : arena->head;
+  if (next == NULL || next->size < need)
+  {
+    size_t csize = need > arena->chunk_size ? need : arena->chunk_size;
+    cod_arena_chunk *c = malloc(sizeof(cod_arena_chunk) + csize);
+    assert(c);
+    c->size = csize;
+    c->next = next;
+    if (arena->cur)
+      arena->cur->next = c;
+    else
+      arena->head = c;
+    next = c;
+  }
+  enter_chunk(arena, next);
+  return cod_arena_alloc_aligned(arena, size, align);
+}
+
+void*
+cod_arena_realloc(cod_arena *arena, void *ptr, size_t oldsize, size_t newsize)
+{
+  if (ptr == NULL)
+    return cod_arena_alloc(arena, newsize);
+
+  if (ptr == arena->last && newsize <= (size_t)(arena->end - (char*)ptr))
+  {
+    arena->ptr = (char*)ptr + newsize;
+    return ptr;
+  }
+  if (newsize <= oldsize)
+    return ptr;
+
+  void *p = cod_arena_alloc(arena, newsize);
+  memcpy(p, ptr, oldsize);
+  return p;
+}
+
+void
+cod_arena_rewind(cod_arena *arena, cod_arena_mark mark)
+{
+  if (mark.chunk == NULL)
+  {
+    /* Taken before the first allocation. */
+    cod_arena_reset(arena);
+    return;
+  }
+  arena->cur = mark.chunk;
+  arena->ptr = mark.ptr;
+  arena->end = mark.chunk->data + mark.chunk->size;
+  arena->last = NULL;
+}
+
+void
+cod_arena_reset(cod_arena *arena)
+{
+  if (arena->head)
+    enter_chunk(arena, arena->head);
+  arena->last = NULL;
+}
+
+cod_arena*
+cod_arena_use(cod_arena *arena)
+{
+  cod_arena *prev = current;
+  current = arena;
+  return prev;
+}
+
+/******************************************************************************
+ * malloc()-compatible interface
+ */
+#define HEADER COD_ARENA_ALIGN
+
+static inline size_t*
+block_size(void *ptr)
+{ return (size_t*)((char*)ptr - HEADER); }
+
+static void*
+block_alloc(cod_arena *arena, size_t size)
+{
+  char *p = cod_arena_alloc(arena, HEADER + size);
+  *(size_t*)p = size;
+  return p + HEADER;
+}
+
+static void*
+block_realloc(cod_arena *arena, void *ptr, size_t size)
+{
+  if (ptr == NULL)
+    return block_alloc(arena, size);
+  size_t oldsize = *block_size(ptr);
+  char *p = cod_arena_realloc(arena, block_size(ptr), HEADER + oldsize,
+      HEADER + size);
+  *(size_t*)p = size;
+  return p + HEADER;
+}
+
+static void
+block_free(cod_arena *arena, void *ptr)
+{
+  if (ptr && (char*)block_size(ptr) == arena->last)
+  {
+    arena->ptr = arena->last;
+    arena->last = NULL;
+  }
+}
+
+void*
+cod_arena_malloc(size_t size)
+{
+  cod_arena *arena = current;
+  return arena ? block_alloc(arena, size) : malloc(size);
+}
+
+void*
+cod_arena_calloc(size_t n, size_t size)
+{
+  if (current == NULL)
+    return calloc(n, size);
+  if (size && n > SIZE_MAX / size)
+    return NULL;
+  void *p = block_alloc(current, n * size);
+  memset(p, 0, n * size);
+  return p;
+}
+
+void*
+cod_arena_realloc_block(void *ptr, size_t size)
+{
+  cod_arena *arena = current;
+  return arena ? block_realloc(arena, ptr, size) : realloc(ptr, size);
+}
+
+void
+cod_arena_free(void *ptr)
+{
+  cod_arena *arena = current;
+  if (arena)
+    block_free(arena, ptr);
+  else
+    free(ptr);
+}
+
+static void*
+allocator_alloc(void *ctx, size_t size)
+{ return block_alloc(ctx, size); }
+
+static void*
+allocator_realloc(void *ctx, void *ptr, size_t size)
+{ return block_realloc(ctx, ptr, size); }
+
+static void
+allocator_free(void *ctx, void *ptr)
+{ block_free(ctx, ptr); }
+
+cod_allocator
+cod_arena_allocator(cod_arena *arena)
+{
+  return (cod_allocator) {
+    .alloc = allocator_alloc,
+    .realloc = allocator_realloc,
+    .free = allocator_free,
+    .ctx = arena,
+  };
+}
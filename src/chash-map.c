@@ -0,0 +1,423 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "codeine/chash-map.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * Memory ordering:
+ * Writers publish new buckets/tables with SC stores, and then read the global
+ * epoch to tag retired objects. Readers store the global epoch into their slot
+ * and then load table and bucket pointers, all with SC operations. Thus, if
+ * reclamation (which bumps the epoch and then scans reader slots) does not see
+ * a reader, this reader is guaranteed to observe the new pointers. A retired
+ * object is freed only when all active readers have entered in an epoch later
+ * than the one it was tagged with.
+ */
+
+#define SHARD_INIT_CAP 0x10
+
+typedef struct {
+  size_t len;
+  cod_hash_map_elt elts[];
+} cod_chash_bucket;
+
+struct cod_chash_table {
+  size_t cap;
+  cod_chash_bucket *buckets[];
+};
+
+static void
+free_mem(void *ptr)
+{ cod_free(ptr); }
+
+static cod_chash_table*
+table_new(size_t cap)
+{
+  cod_chash_table *tab =
+    cod_calloc(1, sizeof(cod_chash_table) + sizeof(cod_chash_bucket*) * cap);
+  tab->cap = cap;
+  return tab;
+}
+
+static cod_chash_bucket*
+bucket_new(size_t len)
+{
+  cod_chash_bucket *buck =
+    cod_malloc(sizeof(cod_chash_bucket) + sizeof(cod_hash_map_elt) * len);
+  buck->len = len;
+  return buck;
+}
+
+static inline cod_chash_shard*
+shard_of(const cod_chash_map *map, uint32_t hash)
+{ return map->shards + ((uint64_t)hash >> map->shard_shift); }
+
+static inline size_t
+key_len(const cod_chash_map *map, const char *key)
+{ return (map->flags & COD_HASH_MAP_INTKEYS) ? 0 : strlen(key); }
+
+static long
+bucket_find(const cod_chash_map *map, const cod_chash_bucket *buck,
+    const void *key, size_t len, uint32_t hash)
+{
+  if (buck == NULL)
+    return -1;
+
+  for (size_t i = 0; i < buck->len; ++i)
+  {
+    const cod_hash_map_elt *elt = buck->elts + i;
+    if (elt->hash != hash)
+      continue;
+    if (map->flags & COD_HASH_MAP_INTKEYS)
+    {
+      if (elt->key == key)
+        return i;
+    }
+    else if (elt->klen == len && memcmp(elt->key, key, len) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void
+reclaim(cod_chash_map *map, cod_chash_shard *shard)
+{
+  __atomic_fetch_add(&map->epoch, 1, __ATOMIC_SEQ_CST);
+
+  uint64_t minepoch = UINT64_MAX;
+  unsigned nreaders = __atomic_load_n(&map->nreaders, __ATOMIC_SEQ_CST);
+  for (unsigned i = 0; i < nreaders; ++i)
+  {
+    uint64_t e = __atomic_load_n(&map->readers[i].epoch, __ATOMIC_SEQ_CST);
+    if (e && e < minepoch)
+      minepoch = e;
+  }
+
+  size_t j = 0;
+  for (size_t i = 0; i < shard->limbo.len; ++i)
+  {
+    cod_chash_retired *r = shard->limbo.data + i;
+    if (r->epoch < minepoch)
+      r->dtor(r->ptr);
+    else
+      shard->limbo.data[j++] = *r;
+  }
+  shard->limbo.len = j;
+}
+
+/* Schedule object for destruction once no reader can hold it. Must be called
+ * after the object has been unlinked. */
+static void
+retire(cod_chash_map *map, cod_chash_shard *shard, void *ptr,
+    void (*dtor)(void*))
+{
+  if (dtor == cod_dummy_dtor)
+    return;
+
+  uint64_t epoch = __atomic_load_n(&map->epoch, __ATOMIC_SEQ_CST);
+  cod_chash_retired r = { ptr, dtor, epoch };
+  cod_vec_push(shard->limbo, r);
+  if (shard->limbo.len % COD_CHASH_MAP_RECLAIM_BATCH == 0)
+    reclaim(map, shard);
+}
+
+static inline void
+publish(void *dst, void *ptr)
+{ __atomic_store_n((void**)dst, ptr, __ATOMIC_SEQ_CST); }
+
+/* Double the table of the shard. Elements of old bucket `i` either stay in
+ * bucket `i`, or move to bucket `i + oldcap`. */
+static void
+grow(cod_chash_map *map, cod_chash_shard *shard)
+{
+  cod_chash_table *oldtab = shard->table;
+  size_t oldcap = oldtab->cap;
+  cod_chash_table *newtab = table_new(oldcap << 1);
+
+  for (size_t ib = 0; ib < oldcap; ++ib)
+  {
+    cod_chash_bucket *buck = oldtab->buckets[ib];
+    if (buck == NULL)
+      continue;
+
+    size_t nhi = 0;
+    for (size_t i = 0; i < buck->len; ++i)
+      nhi += (buck->elts[i].hash & oldcap) != 0;
+
+    cod_chash_bucket *lo = buck->len - nhi ? bucket_new(buck->len - nhi) : NULL;
+    cod_chash_bucket *hi = nhi ? bucket_new(nhi) : NULL;
+    size_t ilo = 0, ihi = 0;
+    for (size_t i = 0; i < buck->len; ++i)
+    {
+      if (buck->elts[i].hash & oldcap)
+        hi->elts[ihi++] = buck->elts[i];
+      else
+        lo->elts[ilo++] = buck->elts[i];
+    }
+    newtab->buckets[ib] = lo;
+    newtab->buckets[ib + oldcap] = hi;
+  }
+
+  publish(&shard->table, newtab);
+  for (size_t ib = 0; ib < oldcap; ++ib)
+  {
+    if (oldtab->buckets[ib])
+      retire(map, shard, oldtab->buckets[ib], free_mem);
+  }
+  retire(map, shard, oldtab, free_mem);
+}
+
+cod_chash_map*
+cod_chash_map_new(int flags, unsigned nshards)
+{
+  assert(!(flags & ~COD_HASH_MAP_INTKEYS));
+  assert(nshards > 0);
+
+  /* Shards and reader slots are cache-line aligned. */
+  void *mem;
+  int err = posix_memalign(&mem, 64, sizeof(cod_chash_map));
+  assert(err == 0);
+  cod_chash_map *map = mem;
+  memset(map, 0, sizeof(cod_chash_map));
+  nshards = cod_rndup2_u32(nshards);
+  map->flags = flags;
+  map->nshards = nshards;
+  map->shard_shift = 32 - __builtin_ctz(nshards);
+  map->epoch = 1;
+  map->nreaders = 0;
+
+  err = posix_memalign(&mem, 64, sizeof(cod_chash_shard) * nshards);
+  assert(err == 0);
+  map->shards = mem;
+  for (unsigned i = 0; i < nshards; ++i)
+  {
+    cod_chash_shard *shard = map->shards + i;
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->table = table_new(SHARD_INIT_CAP);
+    shard->size = 0;
+    cod_vec_init(shard->limbo);
+  }
+  return map;
+}
+
+void
+cod_chash_map_delete(cod_chash_map *map, void (*dtor)(void*))
+{
+  if (dtor == NULL)
+    dtor = cod_dummy_dtor;
+
+  for (unsigned i = 0; i < map->nshards; ++i)
+  {
+    cod_chash_shard *shard = map->shards + i;
+
+    for (size_t j = 0; j < shard->limbo.len; ++j)
+      shard->limbo.data[j].dtor(shard->limbo.data[j].ptr);
+    cod_vec_destroy(shard->limbo);
+
+    cod_chash_table *tab = shard->table;
+    for (size_t ib = 0; ib < tab->cap; ++ib)
+    {
+      cod_chash_bucket *buck = tab->buckets[ib];
+      if (buck == NULL)
+        continue;
+      for (size_t j = 0; j < buck->len; ++j)
+      {
+        dtor(buck->elts[j].val);
+        if (!(map->flags & COD_HASH_MAP_INTKEYS))
+          cod_free(buck->elts[j].key);
+      }
+      cod_free(buck);
+    }
+    cod_free(tab);
+    pthread_mutex_destroy(&shard->lock);
+  }
+  free(map->shards);
+  free(map);
+}
+
+cod_chash_reader*
+cod_chash_map_reader(cod_chash_map *map)
+{
+  for (unsigned i = 0; i < COD_CHASH_MAP_MAX_READERS; ++i)
+  {
+    cod_chash_reader *reader = map->readers + i;
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&reader->used, &expected, 1, 0,
+          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+      unsigned n = __atomic_load_n(&map->nreaders, __ATOMIC_RELAXED);
+      while (n < i + 1 &&
+          !__atomic_compare_exchange_n(&map->nreaders, &n, i + 1, 1,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+      return reader;
+    }
+  }
+  return NULL;
+}
+
+void
+cod_chash_map_release_reader(cod_chash_map *map, cod_chash_reader *reader)
+{
+  (void)map;
+  assert(reader->epoch == 0);
+  __atomic_store_n(&reader->used, 0, __ATOMIC_RELEASE);
+}
+
+int
+cod_chash_map_find_n(cod_chash_map *map, const void *key, size_t len,
+    uint32_t hash, void **val)
+{
+  cod_chash_shard *shard = shard_of(map, hash);
+  cod_chash_table *tab = __atomic_load_n(&shard->table, __ATOMIC_SEQ_CST);
+  cod_chash_bucket *buck =
+    __atomic_load_n(&tab->buckets[hash & (tab->cap - 1)], __ATOMIC_SEQ_CST);
+  long i = bucket_find(map, buck, key, len, hash);
+  if (i < 0)
+    return 0;
+  if (val)
+    *val = buck->elts[i].val;
+  return 1;
+}
+
+int
+cod_chash_map_find(cod_chash_map *map, const char *key, uint32_t hash,
+    void **val)
+{ return cod_chash_map_find_n(map, key, key_len(map, key), hash, val); }
+
+int
+cod_chash_map_insert_n(cod_chash_map *map, const void *key, size_t len,
+    uint32_t hash, void *val, void (*dtor)(void*))
+{
+  assert(len <= UINT32_MAX);
+  cod_chash_shard *shard = shard_of(map, hash);
+  pthread_mutex_lock(&shard->lock);
+
+  cod_chash_table *tab = shard->table;
+  cod_chash_bucket **pbuck = tab->buckets + (hash & (tab->cap - 1));
+  cod_chash_bucket *buck = *pbuck;
+  long i = bucket_find(map, buck, key, len, hash);
+  if (i >= 0)
+  {
+    if (dtor == NULL)
+    {
+      pthread_mutex_unlock(&shard->lock);
+      return 0;
+    }
+
+    void *oldval = buck->elts[i].val;
+    cod_chash_bucket *newbuck = bucket_new(buck->len);
+    memcpy(newbuck->elts, buck->elts, sizeof(cod_hash_map_elt) * buck->len);
+    newbuck->elts[i].val = val;
+    publish(pbuck, newbuck);
+    retire(map, shard, buck, free_mem);
+    retire(map, shard, oldval, dtor);
+  }
+  else
+  {
+    cod_hash_map_elt elt = { .val = val, .hash = hash, .klen = len };
+    if (map->flags & COD_HASH_MAP_INTKEYS)
+    {
+      elt.key = (char*)key;
+    }
+    else
+    {
+      elt.key = cod_malloc(len + 1);
+      memcpy(elt.key, key, len);
+      elt.key[len] = 0;
+    }
+
+    size_t oldlen = buck ? buck->len : 0;
+    cod_chash_bucket *newbuck = bucket_new(oldlen + 1);
+    if (buck)
+      memcpy(newbuck->elts, buck->elts, sizeof(cod_hash_map_elt) * oldlen);
+    newbuck->elts[oldlen] = elt;
+    publish(pbuck, newbuck);
+    if (buck)
+      retire(map, shard, buck, free_mem);
+
+    __atomic_store_n(&shard->size, shard->size + 1, __ATOMIC_RELAXED);
+    if (shard->size > tab->cap * 2)
+      grow(map, shard);
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+  return 1;
+}
+
+int
+cod_chash_map_insert(cod_chash_map *map, const char *key, uint32_t hash,
+    void *val, void (*dtor)(void*))
+{ return cod_chash_map_insert_n(map, key, key_len(map, key), hash, val, dtor); }
+
+int
+cod_chash_map_erase_n(cod_chash_map *map, const void *key, size_t len,
+    uint32_t hash, void (*dtor)(void*))
+{
+  if (dtor == NULL)
+    dtor = cod_dummy_dtor;
+
+  cod_chash_shard *shard = shard_of(map, hash);
+  pthread_mutex_lock(&shard->lock);
+
+  cod_chash_table *tab = shard->table;
+  cod_chash_bucket **pbuck = tab->buckets + (hash & (tab->cap - 1));
+  cod_chash_bucket *buck = *pbuck;
+  long i = bucket_find(map, buck, key, len, hash);
+  if (i < 0)
+  {
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+  }
+
+  cod_hash_map_elt elt = buck->elts[i];
+  cod_chash_bucket *newbuck = NULL;
+  if (buck->len > 1)
+  {
+    newbuck = bucket_new(buck->len - 1);
+    memcpy(newbuck->elts, buck->elts, sizeof(cod_hash_map_elt) * i);
+    memcpy(newbuck->elts + i, buck->elts + i + 1,
+        sizeof(cod_hash_map_elt) * (buck->len - i - 1));
+  }
+  publish(pbuck, newbuck);
+  __atomic_store_n(&shard->size, shard->size - 1, __ATOMIC_RELAXED);
+
+  retire(map, shard, buck, free_mem);
+  if (!(map->flags & COD_HASH_MAP_INTKEYS))
+    retire(map, shard, elt.key, free_mem);
+  retire(map, shard, elt.val, dtor);
+
+  pthread_mutex_unlock(&shard->lock);
+  return 1;
+}
+
+int
+cod_chash_map_erase(cod_chash_map *map, const char *key, uint32_t hash,
+    void (*dtor)(void*))
+{ return cod_chash_map_erase_n(map, key, key_len(map, key), hash, dtor); }
+
+size_t
+cod_chash_map_size(cod_chash_map *map)
+{
+  size_t size = 0;
+  for (unsigned i = 0; i < map->nshards; ++i)
+    size += __atomic_load_n(&map->shards[i].size, __ATOMIC_RELAXED);
+  return size;
+}
@@ -15,260 +15,2059 @@
  */
 #include "codeine/hash-map.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-cod_hash_map*
-cod_hash_map_new(int flags)
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
+/* Counters of COD_HASH_MAP_STATS. Lookups are done on const maps too, hence
+ * the casts. */
+#ifdef COD_HASH_MAP_STATS
+# include <time.h>
+# define STAT_ADD(map, counter, n) \
+  (((cod_hash_map*)(map))->counters.counter += (n))
+
+static inline uint64_t
+stat_clock(void)
 {
-  cod_hash_map *map = cod_malloc(sizeof(cod_hash_map));
-  map->size = 0;
-  map->cap = 0x100;
-  map->flags = flags;
-  map->data = cod_malloc(sizeof(cod_bucket) * map->cap);
-  memset(map->data, 0, sizeof(cod_bucket) * map->cap);
-  return map;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
+# define STAT_TIMER(t) uint64_t t = stat_clock()
+# define STAT_REHASH_DONE(map, t) \
+  STAT_ADD(map, rehash_ns, stat_clock() - (t))
+#else
+# define STAT_ADD(map, counter, n) ((void)0)
+# define STAT_TIMER(t) ((void)0)
+# define STAT_REHASH_DONE(map, t) ((void)0)
+#endif
 
-void
-cod_hash_map_delete(cod_hash_map *restrict map, void (*dtor)(void*))
+static inline int
+key_equal(const cod_hash_map *map, const cod_hash_map_elt *elt,
+    const char *key, size_t len)
 {
-  if (dtor == NULL)
-    dtor = cod_dummy_dtor;
+  if (map->flags & COD_HASH_MAP_INTKEYS)
+    return elt->key == key;
+  else
+    return elt->klen == len && memcmp(elt->key, key, len) == 0;
+}
 
-  for (size_t ibuck = 0; ibuck < map->cap; ++ibuck)
+static inline size_t
+key_len(const cod_hash_map *map, const char *key)
+{ return (map->flags & COD_HASH_MAP_INTKEYS) ? 0 : strlen(key); }
+
+/******************************************************************************
+ * Key storage
+ *
+ * By default each string key is copied into its own malloc'ed buffer. With
+ * COD_HASH_MAP_KEY_ARENA keys are instead bump-allocated from a list of large
+ * chunks, which are released all at once by cod_hash_map_delete(). Erased keys
+ * are only accounted as garbage; once the garbage outweighs live keys, the
+ * live ones are compacted into fresh chunks.
+ */
+struct cod_key_chunk {
+  struct cod_key_chunk *next;
+  size_t size, cap;
+  char data[];
+};
+
+static void
+compact_keys(cod_hash_map *map);
+
+static inline void
+maybe_compact_keys(cod_hash_map *map)
+{
+  if ((map->flags & COD_HASH_MAP_KEY_ARENA) &&
+      map->keys_garbage >= COD_HASH_MAP_KEY_CHUNK &&
+      map->keys_garbage > map->keys_live)
+    compact_keys(map);
+}
+
+static inline int
+keys_malloced(const cod_hash_map *map)
+{ return !(map->flags & (COD_HASH_MAP_INTKEYS | COD_HASH_MAP_KEY_ARENA)); }
+
+static cod_key_chunk*
+new_key_chunk(cod_hash_map *map, size_t cap)
+{
+  cod_key_chunk *chunk = cod_alloc_with(map->allocator,
+      sizeof(cod_key_chunk) + cap);
+  chunk->size = 0;
+  chunk->cap = cap;
+  return chunk;
+}
+
+static char*
+arena_alloc(cod_hash_map *map, size_t n)
+{
+  cod_key_chunk *chunk = map->keys;
+  if (chunk == NULL || chunk->cap - chunk->size < n)
   {
-    cod_bucket *buck = map->data + ibuck;
-    if (buck->data)
+    if (chunk && n > COD_HASH_MAP_KEY_CHUNK / 4)
     {
-      for (size_t ielt = 0; ielt < buck->len; ++ielt)
-      {
-        cod_hash_map_elt *kv = buck->data + ielt;
-        dtor(kv->val);
-        cod_free(kv->key);
-      }
-      cod_vec_destroy(*buck);
+      /* Large key gets a dedicated chunk, and the current one is kept. */
+      cod_key_chunk *big = new_key_chunk(map, n);
+      big->next = chunk->next;
+      chunk->next = big;
+      big->size = n;
+      return big->data;
     }
+    chunk = new_key_chunk(map, n > COD_HASH_MAP_KEY_CHUNK ? n : COD_HASH_MAP_KEY_CHUNK);
+    chunk->next = map->keys;
+    map->keys = chunk;
   }
-  cod_free(map->data);
+  char *ret = chunk->data + chunk->size;
+  chunk->size += n;
+  return ret;
+}
 
-  cod_free(map);
+/* Copied keys are always followed by a terminating zero, so that keys inserted
+ * with explicit length can still be handled as C-strings. */
+static char*
+copy_key(cod_hash_map *map, const char *key, size_t len)
+{
+  char *mykey;
+  if (map->flags & COD_HASH_MAP_KEY_ARENA)
+  {
+    mykey = arena_alloc(map, len + 1);
+    map->keys_live += len + 1;
+  }
+  else
+  {
+    mykey = cod_alloc_with(map->allocator, len + 1);
+  }
+  memcpy(mykey, key, len);
+  mykey[len] = 0;
+  return mykey;
 }
 
-static int
-find(const cod_hash_map *map, const char *key, uint32_t hash,
-    cod_hash_map_iter *iter)
+static inline void
+free_key(cod_hash_map *map, cod_hash_map_elt *elt)
 {
-  size_t buckidx = hash & (map->cap - 1);
-  cod_bucket *buck = map->data + buckidx;
+  if (map->flags & COD_HASH_MAP_INTKEYS)
+    return;
 
-  if (buck->data == NULL)
+  if (map->flags & COD_HASH_MAP_KEY_ARENA)
   {
-    iter->buckidx = buckidx;
-    iter->eltidx = -1;
-    return 0;
+    map->keys_live -= elt->klen + 1;
+    map->keys_garbage += elt->klen + 1;
   }
   else
   {
-    if (map->flags & COD_HASH_MAP_INTKEYS)
+    cod_free_with(map->allocator, elt->key);
+  }
+}
+
+static void
+release_keys(cod_hash_map *map)
+{
+  while (map->keys)
+  {
+    cod_key_chunk *next = map->keys->next;
+    cod_free_with(map->allocator, map->keys);
+    map->keys = next;
+  }
+}
+
+/******************************************************************************
+ * Flat open-addressing engine (COD_HASH_MAP_FLAT)
+ *
+ * Slots are grouped by 16. Each slot has a control byte: either a 7-bit tag
+ * (low bits of the hash), or one of EMPTY/DELETED markers (high bit set).
+ * Groups are probed with triangular sequence over group indices, starting from
+ * the group selected by the upper bits of the hash. Probing stops at the first
+ * group containing an EMPTY slot.
+ */
+#define GROUP_WIDTH 16
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+#define CTRL_TAG(hash) ((int8_t)((hash) & 0x7F))
+#define GROUP_INDEX(hash) ((size_t)(hash) >> 7)
+
+#if defined(__SSE2__)
+typedef uint32_t group_mask;
+# define GROUP_MASK_SHIFT 0
+
+static inline group_mask
+group_match(const int8_t *ctrl, int8_t tag)
+{
+  __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(tag)));
+}
+
+static inline group_mask
+group_match_free(const int8_t *ctrl)
+{
+  /* EMPTY and DELETED are the only ones with the high bit set */
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+}
+
+#elif defined(__ARM_NEON)
+typedef uint64_t group_mask;
+# define GROUP_MASK_SHIFT 2
+
+/* There is no movemask on NEON: narrow each 8-bit lane to 4 bits and keep
+ * a single bit out of each nibble. */
+static inline group_mask
+neon_movemask(uint8x16_t eq)
+{
+  uint8x8_t nib = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nib), 0) & 0x8888888888888888ull;
+}
+
+static inline group_mask
+group_match(const int8_t *ctrl, int8_t tag)
+{
+  return neon_movemask(vceqq_s8(vld1q_s8(ctrl), vdupq_n_s8(tag)));
+}
+
+static inline group_mask
+group_match_free(const int8_t *ctrl)
+{
+  return neon_movemask(vcltq_s8(vld1q_s8(ctrl), vdupq_n_s8(0)));
+}
+
+#else
+typedef uint32_t group_mask;
+# define GROUP_MASK_SHIFT 0
+
+static inline group_mask
+group_match(const int8_t *ctrl, int8_t tag)
+{
+  group_mask m = 0;
+  for (int i = 0; i < GROUP_WIDTH; ++i)
+    m |= (group_mask)(ctrl[i] == tag) << i;
+  return m;
+}
+
+static inline group_mask
+group_match_free(const int8_t *ctrl)
+{
+  group_mask m = 0;
+  for (int i = 0; i < GROUP_WIDTH; ++i)
+    m |= (group_mask)(ctrl[i] < 0) << i;
+  return m;
+}
+#endif
+
+/* Index of the first matched slot within a group. */
+static inline int
+group_first(group_mask m)
+{ return __builtin_ctzll(m) >> GROUP_MASK_SHIFT; }
+
+/* Drop the first match. */
+static inline group_mask
+group_next(group_mask m)
+{ return m & (m - 1); }
+
+static void
+flat_alloc(cod_hash_map *map, size_t cap)
+{
+  assert(cap % GROUP_WIDTH == 0);
+  /* Slots and control bytes share single allocation. */
+  map->cap = cap;
+  map->slots = cod_alloc_with(map->allocator,
+      (sizeof(cod_hash_map_elt) + 1) * cap);
+  map->ctrl = (int8_t*)(map->slots + cap);
+  memset(map->ctrl, CTRL_EMPTY, cap);
+  map->ntomb = 0;
+}
+
+static void
+flat_delete(cod_hash_map *map, void (*dtor)(void*))
+{
+  for (size_t i = 0; i < map->cap; ++i)
+  {
+    if (map->ctrl[i] >= 0)
     {
-      for (size_t i = 0; i < buck->len; ++i)
-      {
-        cod_hash_map_elt *elt = buck->data + i;
-        if (elt->hash == hash && elt->key == key)
-        {
-          iter->buckidx = buckidx;
-          iter->eltidx = i;
-          return 1;
-        }
-      }
+      dtor(map->slots[i].val);
+      if (keys_malloced(map))
+        cod_free_with(map->allocator, map->slots[i].key);
     }
-    else
+  }
+  cod_free_with(map->allocator, map->slots);
+}
+
+static size_t
+flat_find(const cod_hash_map *map, const char *key, size_t len, uint32_t hash)
+{
+  const size_t gmask = map->cap / GROUP_WIDTH - 1;
+  const int8_t tag = CTRL_TAG(hash);
+  size_t g = GROUP_INDEX(hash) & gmask;
+  for (size_t step = 1; ; g = (g + step++) & gmask)
+  {
+    const int8_t *ctrl = map->ctrl + g * GROUP_WIDTH;
+    for (group_mask m = group_match(ctrl, tag); m; m = group_next(m))
     {
-      for (size_t i = 0; i < buck->len; ++i)
+      size_t i = g * GROUP_WIDTH + group_first(m);
+      cod_hash_map_elt *elt = map->slots + i;
+      STAT_ADD(map, probes, 1);
+      if (elt->hash == hash && key_equal(map, elt, key, len))
       {
-        cod_hash_map_elt *elt = buck->data + i;
-        if (elt->hash == hash && strcmp(elt->key, key) == 0)
-        {
-          iter->buckidx = buckidx;
-          iter->eltidx = i;
-          return 1;
-        }
+        STAT_ADD(map, hits, 1);
+        return i;
       }
     }
-
-    iter->buckidx = buckidx;
-    iter->eltidx = -1;
-    return 0;
+    if (group_match(ctrl, CTRL_EMPTY))
+    {
+      STAT_ADD(map, misses, 1);
+      return SIZE_MAX;
+    }
   }
 }
 
-cod_hash_map_elt*
-cod_hash_map_find(const cod_hash_map *map, const char *key, uint32_t hash)
+/* Find first EMPTY or DELETED slot in probe sequence of the hash. */
+static size_t
+flat_find_free(const cod_hash_map *map, uint32_t hash)
 {
-  cod_hash_map_iter iter;
-  if (find(map, key, hash, &iter))
-    return &map->data[iter.buckidx].data[iter.eltidx];
-  else
-    return NULL;
+  const size_t gmask = map->cap / GROUP_WIDTH - 1;
+  size_t g = GROUP_INDEX(hash) & gmask;
+  for (size_t step = 1; ; g = (g + step++) & gmask)
+  {
+    group_mask m = group_match_free(map->ctrl + g * GROUP_WIDTH);
+    if (m)
+      return g * GROUP_WIDTH + group_first(m);
+  }
 }
 
-// TODO: don't reallocate keys
 static void
-rehash(cod_hash_map *map, size_t newcap)
+flat_rehash(cod_hash_map *map, size_t newcap)
 {
   size_t oldcap = map->cap;
-  cod_bucket *olddata = map->data;
-  cod_bucket *newdata = cod_malloc(sizeof(cod_bucket) * newcap);
-  memset(newdata, 0, sizeof(cod_bucket) * newcap);
-
-  map->size = 0;
-  map->cap = newcap;
-  map->data = newdata;
+  cod_hash_map_elt *oldslots = map->slots;
+  int8_t *oldctrl = map->ctrl;
+  STAT_TIMER(t);
 
-  for (size_t ibuck = 0; ibuck < oldcap; ++ibuck)
+  flat_alloc(map, newcap);
+  for (size_t i = 0; i < oldcap; ++i)
   {
-    cod_bucket *buck = olddata + ibuck;
-    if (buck->data)
+    if (oldctrl[i] >= 0)
     {
-      for (size_t ielt = 0; ielt < buck->len; ++ielt)
-      {
-        cod_hash_map_elt *elt = buck->data + ielt;
-        int ok = cod_hash_map_insert_drain(map, elt->key, elt->hash, elt->val, 0);
-        assert(ok);
-      }
-      cod_vec_destroy(*buck);
+      size_t j = flat_find_free(map, oldslots[i].hash);
+      map->ctrl[j] = oldctrl[i];
+      map->slots[j] = oldslots[i];
     }
   }
-  free(olddata);
+  cod_free_with(map->allocator, oldslots);
+  STAT_ADD(map, rehashes, 1);
+  STAT_REHASH_DONE(map, t);
 }
 
 static cod_hash_map_elt*
-raw_insert(cod_hash_map *map, const char *key, size_t hash, void (*dtor)(void*))
+flat_raw_insert(cod_hash_map *map, const char *key, size_t len, uint32_t hash,
+    void (*dtor)(void*), int *isnew)
 {
-  cod_hash_map_iter iter;
-  if (find(map, key, hash, &iter))
+  size_t i = flat_find(map, key, len, hash);
+  if (i != SIZE_MAX)
   {
     if (dtor == NULL) return NULL;
-    cod_hash_map_elt *elt = &map->data[iter.buckidx].data[iter.eltidx];
+    cod_hash_map_elt *elt = map->slots + i;
     dtor(elt->val);
+    *isnew = 0;
     return elt;
   }
-  else
-  {
-    if ((map->size >> (cod_log2_u64(map->cap) - 1)) > 2)
-    {
-      rehash(map, map->cap << 1);
-      return raw_insert(map, key, hash, dtor);
-    }
-
-    cod_bucket *buck = map->data + iter.buckidx;
-    if (map->data[iter.buckidx].data == NULL)
-      cod_vec_init(*buck);
 
-    cod_hash_map_elt elt = { 0 };
-    cod_vec_push(*buck, elt);
-    map->size += 1;
-    return &cod_vec_last(*buck);
+  /* Keep load factor (including tombstones) below 7/8. */
+  if ((map->size + map->ntomb + 1) * 8 > map->cap * 7)
+  {
+    /* Just drop the tombstones if they make up a large part of the load. */
+    if (map->ntomb > map->size / 2)
+      flat_rehash(map, map->cap);
+    else
+      flat_rehash(map, map->cap << 1);
   }
+
+  i = flat_find_free(map, hash);
+  if (map->ctrl[i] == CTRL_DELETED)
+    map->ntomb -= 1;
+  map->ctrl[i] = CTRL_TAG(hash);
+  map->size += 1;
+  *isnew = 1;
+  return map->slots + i;
 }
 
-int
-cod_hash_map_insert(cod_hash_map *map, const char *key, size_t hash, void *val,
+static int
+flat_erase(cod_hash_map *map, const char *key, size_t len, uint32_t hash,
     void (*dtor)(void*))
 {
-  cod_hash_map_elt *elt = raw_insert(map, key, hash, dtor);
-  if (elt == NULL) return 0;
+  size_t i = flat_find(map, key, len, hash);
+  if (i == SIZE_MAX)
+    return 0;
 
-  if (map->flags & COD_HASH_MAP_INTKEYS)
+  cod_hash_map_elt *elt = map->slots + i;
+  free_key(map, elt);
+  maybe_compact_keys(map);
+  dtor(elt->val);
+  /* If there is an EMPTY slot in this group, then no probe sequence can pass
+   * through it, so the slot can be marked EMPTY rather than DELETED. */
+  const int8_t *group = map->ctrl + i / GROUP_WIDTH * GROUP_WIDTH;
+  if (group_match(group, CTRL_EMPTY))
   {
-    elt->key = (char*)key;
+    map->ctrl[i] = CTRL_EMPTY;
   }
   else
   {
-    int len = strlen(key);
-    char *mykey = cod_malloc(len + 1);
-    memcpy(mykey, key, len + 1);
-    elt->key = mykey;
+    map->ctrl[i] = CTRL_DELETED;
+    map->ntomb += 1;
   }
-  elt->hash = hash;
-  elt->val = val;
+  map->size -= 1;
   return 1;
 }
 
-int
-cod_hash_map_insert_drain(cod_hash_map *map, char *key, size_t hash, void *val,
-    void (*dtor)(void*))
+static int
+flat_next_slot(const cod_hash_map *map, size_t from)
 {
-  cod_hash_map_elt *elt = raw_insert(map, key, hash, dtor);
-  if (elt == NULL) return 0;
+  for (size_t i = from; i < map->cap; ++i)
+  {
+    if (map->ctrl[i] >= 0)
+      return i;
+  }
+  return -1;
+}
 
-  elt->key = key;
-  elt->hash = hash;
-  elt->val = val;
-  return 1;
+/******************************************************************************
+ * Insertion-ordered engine (COD_HASH_MAP_ORDERED)
+ *
+ * Elements are appended to a dense array of entries, and the table (index) only
+ * maps hashes to positions in this array. Probing follows CPython's dicts: the
+ * recurrence i = 5*i + 1 visits every slot, and mixing in the higher bits of
+ * the hash early on breaks up clusters of hashes with poor low bits (like
+ * cod_djb2() for similar keys). The index has
+ * `cap` slots of the smallest width able to hold `ORD_USABLE(cap)` positions
+ * along with two markers: EMPTY (all ones) and DUMMY (erased). Entries array
+ * is allocated together with the index and holds `ORD_USABLE(cap)` elements;
+ * once it is used up, the live entries are compacted into a new allocation
+ * (twice as large, unless erased entries made up at least half of it).
+ */
+#define ORD_MINCAP 8
+#define ORD_USABLE(cap) ((cap) * 2 / 3)
+#define IDX_EMPTY SIZE_MAX
+#define IDX_DUMMY (SIZE_MAX - 1)
+/* Erased entries are marked by a key length no live key can have (see the
+ * asserts in cod_hash_map_insert_n() and cod_hash_map_entry_n()). */
+#define ORD_ERASED(elt) ((elt)->klen == UINT32_MAX)
+#define ORD_PERTURB_SHIFT 5
+#define ORD_NEXT(i, perturb, mask) \
+  ((perturb) >>= ORD_PERTURB_SHIFT, ((i) * 5 + (perturb) + 1) & (mask))
+
+static inline unsigned
+idx_width(size_t cap)
+{
+  if (cap <= 0x100) return 1;
+  if (cap <= 0x10000) return 2;
+  if (cap <= 0x100000000ull) return 4;
+  return 8;
 }
 
-int
-cod_hash_map_erase(cod_hash_map *map, const char *key, size_t hash,
-    void (*dtor)(void*))
+static inline size_t
+idx_get(const cod_hash_map *map, size_t i)
 {
-  if (dtor == NULL)
-    dtor = cod_dummy_dtor;
+  uint64_t x;
+  unsigned w = idx_width(map->cap);
+  switch (w)
+  {
+    case 1: x = ((const uint8_t*)map->index)[i]; break;
+    case 2: x = ((const uint16_t*)map->index)[i]; break;
+    case 4: x = ((const uint32_t*)map->index)[i]; break;
+    default: return ((const uint64_t*)map->index)[i];
+  }
+  /* Widen the markers. */
+  uint64_t max = (1ull << (w * 8)) - 1;
+  if (x >= max - 1)
+    return x == max ? IDX_EMPTY : IDX_DUMMY;
+  return x;
+}
 
-  cod_hash_map_iter iter;
-  if (find(map, key, hash, &iter))
+static inline void
+idx_set(cod_hash_map *map, size_t i, size_t x)
+{
+  /* Markers are truncated into the narrow ones. */
+  switch (idx_width(map->cap))
   {
-    cod_bucket *buck = map->data + iter.buckidx;
-    cod_hash_map_elt *elt = buck->data + iter.eltidx;
-    cod_free(elt->key);
-    dtor(elt->val);
-    cod_vec_erase(*buck, iter.eltidx);
-    return 1;
+    case 1: ((uint8_t*)map->index)[i] = x; break;
+    case 2: ((uint16_t*)map->index)[i] = x; break;
+    case 4: ((uint32_t*)map->index)[i] = x; break;
+    default: ((uint64_t*)map->index)[i] = x; break;
   }
-  else
+}
+
+static void
+ord_alloc(cod_hash_map *map, size_t cap)
+{
+  /* Entries and index share single allocation. */
+  size_t usable = ORD_USABLE(cap);
+  map->cap = cap;
+  map->entries = cod_alloc_with(map->allocator,
+      sizeof(cod_hash_map_elt) * usable + idx_width(cap) * cap);
+  map->index = map->entries + usable;
+  memset(map->index, 0xFF, idx_width(cap) * cap);
+  map->nentries = 0;
+}
+
+static void
+ord_delete(cod_hash_map *map, void (*dtor)(void*))
+{
+  for (size_t i = 0; i < map->nentries; ++i)
   {
-    return 0;
+    cod_hash_map_elt *elt = map->entries + i;
+    if (ORD_ERASED(elt))
+      continue;
+    dtor(elt->val);
+    if (keys_malloced(map))
+      cod_free_with(map->allocator, elt->key);
   }
+  cod_free_with(map->allocator, map->entries);
 }
 
-static int
-next_bucket(const cod_hash_map *map, int from)
+/* Find the index slot referring to the key. */
+static size_t
+ord_find_slot(const cod_hash_map *map, const char *key, size_t len,
+    uint32_t hash)
 {
-  for (size_t i = from; i < map->cap; ++i)
+  const size_t mask = map->cap - 1;
+  size_t perturb = hash;
+  for (size_t i = hash & mask; ; i = ORD_NEXT(i, perturb, mask))
   {
-    cod_bucket *buck = map->data + i;
-    if (buck->data && buck->len > 0)
+    size_t ix = idx_get(map, i);
+    if (ix == IDX_EMPTY)
+    {
+      STAT_ADD(map, misses, 1);
+      return SIZE_MAX;
+    }
+    if (ix == IDX_DUMMY)
+      continue;
+    cod_hash_map_elt *elt = map->entries + ix;
+    STAT_ADD(map, probes, 1);
+    if (elt->hash == hash && key_equal(map, elt, key, len))
+    {
+      STAT_ADD(map, hits, 1);
       return i;
+    }
   }
-  return -1;
 }
 
-void
-cod_hash_map_begin(const cod_hash_map *map, cod_hash_map_iter *iter)
+static inline cod_hash_map_elt*
+ord_find(const cod_hash_map *map, const char *key, size_t len, uint32_t hash)
 {
-  int ib = next_bucket(map, 0);
-  iter->buckidx = ib;
-  iter->eltidx = 0;
+  size_t i = ord_find_slot(map, key, len, hash);
+  return i == SIZE_MAX ? NULL : map->entries + idx_get(map, i);
 }
 
-int
-cod_hash_map_next(const cod_hash_map *map, char **key, void *val,
-    cod_hash_map_iter *iter)
+/* Find first EMPTY or DUMMY slot for the hash. */
+static size_t
+ord_find_free(const cod_hash_map *map, uint32_t hash)
 {
-  if (iter->buckidx < 0)
-    return 0;
+  const size_t mask = map->cap - 1;
+  size_t perturb = hash;
+  size_t i = hash & mask;
+  while (idx_get(map, i) < IDX_DUMMY)
+    i = ORD_NEXT(i, perturb, mask);
+  return i;
+}
 
-  cod_bucket *buck = map->data + iter->buckidx;
+/* Move live entries (in their order) into a new allocation, and rebuild the
+ * index. */
+static void
+ord_rebuild(cod_hash_map *map, size_t newcap)
+{
+  cod_hash_map_elt *oldentries = map->entries;
+  size_t oldn = map->nentries;
+  STAT_TIMER(t);
 
-  if (key) *key = buck->data[iter->eltidx].key;
-  if (val) *(void**)val = buck->data[iter->eltidx].val;
+  ord_alloc(map, newcap);
+  for (size_t i = 0; i < oldn; ++i)
+  {
+    if (ORD_ERASED(oldentries + i))
+      continue;
+    idx_set(map, ord_find_free(map, oldentries[i].hash), map->nentries);
+    map->entries[map->nentries++] = oldentries[i];
+  }
+  cod_free_with(map->allocator, oldentries);
+  STAT_ADD(map, rehashes, 1);
+  STAT_REHASH_DONE(map, t);
+}
 
-  if (++iter->eltidx == (int)buck->len)
+static cod_hash_map_elt*
+ord_raw_insert(cod_hash_map *map, const char *key, size_t len, uint32_t hash,
+    void (*dtor)(void*), int *isnew)
+{
+  cod_hash_map_elt *elt = ord_find(map, key, len, hash);
+  if (elt)
   {
-    iter->buckidx = next_bucket(map, iter->buckidx + 1);
-    iter->eltidx = 0;
+    if (dtor == NULL) return NULL;
+    dtor(elt->val);
+    *isnew = 0;
+    return elt;
+  }
+
+  if (map->nentries == ORD_USABLE(map->cap))
+  {
+    /* Just compact the entries if erased ones make up a half of them. */
+    if (map->size * 2 < map->nentries)
+      ord_rebuild(map, map->cap);
+    else
+      ord_rebuild(map, map->cap << 1);
   }
+
+  idx_set(map, ord_find_free(map, hash), map->nentries);
+  elt = map->entries + map->nentries++;
+  map->size += 1;
+  *isnew = 1;
+  return elt;
+}
+
+static int
+ord_erase(cod_hash_map *map, const char *key, size_t len, uint32_t hash,
+    void (*dtor)(void*))
+{
+  size_t i = ord_find_slot(map, key, len, hash);
+  if (i == SIZE_MAX)
+    return 0;
+
+  size_t ix = idx_get(map, i);
+  cod_hash_map_elt *elt = map->entries + ix;
+  free_key(map, elt);
+  dtor(elt->val);
+  elt->klen = UINT32_MAX;
+  /* The entry is not reused even if it is the last one: the DUMMY slot left
+   * in the index is only dropped by a rebuild, which is triggered by
+   * `nentries` reaching ORD_USABLE(). */
+  idx_set(map, i, IDX_DUMMY);
+  map->size -= 1;
+  maybe_compact_keys(map);
   return 1;
 }
+
+static int
+ord_next_entry(const cod_hash_map *map, size_t from)
+{
+  for (size_t i = from; i < map->nentries; ++i)
+  {
+    if (!ORD_ERASED(map->entries + i))
+      return i;
+  }
+  return -1;
+}
+
+/* Smallest table size able to hold `n` elements without growing. */
+static size_t
+capacity_for(int flags, size_t n)
+{
+  size_t cap;
+  if (flags & COD_HASH_MAP_ORDERED)
+  {
+    /* At most 2/3 of the index is used. */
+    cap = cod_rndup2_u64((n * 3 + 1) / 2);
+    return cap < ORD_MINCAP ? ORD_MINCAP : cap;
+  }
+  else if (flags & COD_HASH_MAP_FLAT)
+  {
+    /* Load factor is kept below 7/8. */
+    cap = cod_rndup2_u64((n * 8 + 6) / 7);
+    return cap < GROUP_WIDTH ? GROUP_WIDTH : cap;
+  }
+  else
+  {
+    /* Table grows once average chain length reaches 3. */
+    cap = cod_rndup2_u64((n + 2) / 3);
+    return cap < 1 ? 1 : cap;
+  }
+}
+
+/* The single bucket of a small map is stored inline. */
+static inline void
+free_table(cod_hash_map *map, cod_bucket *data)
+{
+  if (data != &map->small)
+    cod_free_with(map->allocator, data);
+}
+
+static cod_hash_map*
+new_with_table(int flags, size_t cap, const cod_allocator *allocator)
+{
+  cod_hash_map *map = cod_alloc_with(allocator, sizeof(cod_hash_map));
+  map->allocator = allocator;
+  map->size = 0;
+  map->cap = cap;
+  map->flags = flags;
+  map->data = NULL;
+  map->olddata = NULL;
+  map->oldcap = 0;
+  map->rehashidx = 0;
+  map->slots = NULL;
+  map->ctrl = NULL;
+  map->ntomb = 0;
+  map->entries = NULL;
+  map->nentries = 0;
+  map->index = NULL;
+  map->keys = NULL;
+  map->keys_live = 0;
+  map->keys_garbage = 0;
+#ifdef COD_HASH_MAP_STATS
+  memset(&map->counters, 0, sizeof(map->counters));
+#endif
+  if (flags & COD_HASH_MAP_ORDERED)
+  {
+    ord_alloc(map, map->cap);
+  }
+  else if (flags & COD_HASH_MAP_FLAT)
+  {
+    flat_alloc(map, map->cap);
+  }
+  else if (cap == 1)
+  {
+    cod_vec_init(map->small);
+    map->data = &map->small;
+  }
+  else
+  {
+    map->data = cod_calloc_with(allocator, map->cap, sizeof(cod_bucket));
+  }
+  return map;
+}
+
+cod_hash_map*
+cod_hash_map_new(int flags)
+{ return cod_hash_map_new_with_capacity(flags, 0); }
+
+cod_hash_map*
+cod_hash_map_new_with_capacity(int flags, size_t n)
+{ return new_with_table(flags, capacity_for(flags, n), NULL); }
+
+cod_hash_map*
+cod_hash_map_new_with_allocator(int flags, size_t n,
+    const cod_allocator *allocator)
+{ return new_with_table(flags, capacity_for(flags, n), allocator); }
+
+void
+cod_hash_map_delete(cod_hash_map *restrict map, void (*dtor)(void*))
+{
+  if (dtor == NULL)
+    dtor = cod_dummy_dtor;
+
+  if (map->flags & (COD_HASH_MAP_FLAT | COD_HASH_MAP_ORDERED))
+  {
+    if (map->flags & COD_HASH_MAP_ORDERED)
+      ord_delete(map, dtor);
+    else
+      flat_delete(map, dtor);
+    release_keys(map);
+    cod_free_with(map->allocator, map);
+    return;
+  }
+
+  for (size_t ibuck = 0; ibuck < map->cap; ++ibuck)
+  {
+    cod_bucket *buck = map->data + ibuck;
+    if (buck->data)
+    {
+      for (size_t ielt = 0; ielt < buck->len; ++ielt)
+      {
+        cod_hash_map_elt *kv = buck->data + ielt;
+        dtor(kv->val);
+        if (keys_malloced(map))
+          cod_free_with(map->allocator, kv->key);
+      }
+      cod_vec_destroy_with(*buck, map->allocator);
+    }
+  }
+  free_table(map, map->data);
+
+  if (map->olddata)
+  {
+    for (size_t ibuck = map->rehashidx; ibuck < map->oldcap; ++ibuck)
+    {
+      cod_bucket *buck = map->olddata + ibuck;
+      for (size_t ielt = 0; ielt < buck->len; ++ielt)
+      {
+        dtor(buck->data[ielt].val);
+        if (keys_malloced(map))
+          cod_free_with(map->allocator, buck->data[ielt].key);
+      }
+      cod_vec_destroy_with(*buck, map->allocator);
+    }
+    free_table(map, map->olddata);
+  }
+
+  release_keys(map);
+  cod_free_with(map->allocator, map);
+}
+
+/* Find element in the chain for the hash. On success, the bucket holding the
+ * element is returned via `pbuck`; otherwise `pbuck` receives the bucket where
+ * the key should be inserted. */
+static cod_hash_map_elt*
+find(const cod_hash_map *map, const char *key, size_t len, uint32_t hash,
+    cod_bucket **pbuck)
+{
+  if (map->olddata)
+  {
+    /* Still not migrated part of the old table during incremental rehash. */
+    size_t oldidx = hash & (map->oldcap - 1);
+    if (oldidx >= map->rehashidx)
+    {
+      cod_bucket *buck = map->olddata + oldidx;
+      for (size_t i = 0; i < buck->len; ++i)
+      {
+        cod_hash_map_elt *elt = buck->data + i;
+        STAT_ADD(map, probes, 1);
+        if (elt->hash == hash && key_equal(map, elt, key, len))
+        {
+          STAT_ADD(map, hits, 1);
+          *pbuck = buck;
+          return elt;
+        }
+      }
+    }
+  }
+
+  cod_bucket *buck = map->data + (hash & (map->cap - 1));
+  *pbuck = buck;
+  for (size_t i = 0; i < buck->len; ++i)
+  {
+    cod_hash_map_elt *elt = buck->data + i;
+    STAT_ADD(map, probes, 1);
+    if (elt->hash == hash && key_equal(map, elt, key, len))
+    {
+      STAT_ADD(map, hits, 1);
+      return elt;
+    }
+  }
+  STAT_ADD(map, misses, 1);
+  return NULL;
+}
+
+cod_hash_map_elt*
+cod_hash_map_find_n(const cod_hash_map *map, const void *key, size_t len,
+    uint32_t hash)
+{
+  if (map->flags & COD_HASH_MAP_ORDERED)
+    return ord_find(map, key, len, hash);
+
+  if (map->flags & COD_HASH_MAP_FLAT)
+  {
+    size_t i = flat_find(map, key, len, hash);
+    return i == SIZE_MAX ? NULL : map->slots + i;
+  }
+
+  cod_bucket *buck;
+  return find(map, key, len, hash, &buck);
+}
+
+cod_hash_map_elt*
+cod_hash_map_find(const cod_hash_map *map, const char *key, uint32_t hash)
+{ return cod_hash_map_find_n(map, key, key_len(map, key), hash); }
+
+/* Prefetch keys of the elements which hash matches (integer keys are not
+ * pointers). */
+static inline void
+prefetch_keys(const cod_hash_map *map, const cod_hash_map_elt *elts,
+    size_t n, uint32_t hash)
+{
+  if (map->flags & COD_HASH_MAP_INTKEYS)
+    return;
+  for (size_t i = 0; i < n; ++i)
+  {
+    if (elts[i].hash == hash)
+      __builtin_prefetch(elts[i].key);
+  }
+}
+
+static void
+find_batch_chain(const cod_hash_map *map, const char *const *keys,
+    const uint32_t *hashes, size_t n, cod_hash_map_elt **out)
+{
+  const int strkeys = !(map->flags & COD_HASH_MAP_INTKEYS);
+  cod_bucket *bucks[COD_HASH_MAP_BATCH];
+
+  /* Stage 1: bucket headers. */
+  for (size_t i = 0; i < n; ++i)
+  {
+    bucks[i] = map->data + (hashes[i] & (map->cap - 1));
+    __builtin_prefetch(bucks[i]);
+    if (map->olddata)
+      __builtin_prefetch(map->olddata + (hashes[i] & (map->oldcap - 1)));
+  }
+
+  /* Stage 2: element arrays. */
+  for (size_t i = 0; i < n; ++i)
+    __builtin_prefetch(bucks[i]->data);
+
+  /* Stage 3: keys of the elements with matching hash. */
+  if (strkeys)
+  {
+    for (size_t i = 0; i < n; ++i)
+      prefetch_keys(map, bucks[i]->data, bucks[i]->len, hashes[i]);
+  }
+
+  /* Stage 4: compare. */
+  for (size_t i = 0; i < n; ++i)
+  {
+    cod_bucket *buck;
+    out[i] = find(map, keys[i], key_len(map, keys[i]), hashes[i], &buck);
+  }
+}
+
+static void
+find_batch_flat(const cod_hash_map *map, const char *const *keys,
+    const uint32_t *hashes, size_t n, cod_hash_map_elt **out)
+{
+  const int strkeys = !(map->flags & COD_HASH_MAP_INTKEYS);
+  const size_t gmask = map->cap / GROUP_WIDTH - 1;
+  size_t groups[COD_HASH_MAP_BATCH];
+
+  /* Stage 1: control bytes of the first group of the probe sequences. */
+  for (size_t i = 0; i < n; ++i)
+  {
+    groups[i] = (GROUP_INDEX(hashes[i]) & gmask) * GROUP_WIDTH;
+    __builtin_prefetch(map->ctrl + groups[i]);
+  }
+
+  /* Stage 2: slots with matching tag. */
+  for (size_t i = 0; i < n; ++i)
+  {
+    group_mask m = group_match(map->ctrl + groups[i], CTRL_TAG(hashes[i]));
+    for (; m; m = group_next(m))
+      __builtin_prefetch(map->slots + groups[i] + group_first(m));
+  }
+
+  /* Stage 3: keys of the slots with matching hash. */
+  if (strkeys)
+  {
+    for (size_t i = 0; i < n; ++i)
+    {
+      group_mask m = group_match(map->ctrl + groups[i], CTRL_TAG(hashes[i]));
+      for (; m; m = group_next(m))
+        prefetch_keys(map, map->slots + groups[i] + group_first(m), 1, hashes[i]);
+    }
+  }
+
+  /* Stage 4: compare. */
+  for (size_t i = 0; i < n; ++i)
+  {
+    size_t j = flat_find(map, keys[i], key_len(map, keys[i]), hashes[i]);
+    out[i] = j == SIZE_MAX ? NULL : map->slots + j;
+  }
+}
+
+static void
+find_batch_ordered(const cod_hash_map *map, const char *const *keys,
+    const uint32_t *hashes, size_t n, cod_hash_map_elt **out)
+{
+  const int strkeys = !(map->flags & COD_HASH_MAP_INTKEYS);
+  const unsigned width = idx_width(map->cap);
+  size_t ixs[COD_HASH_MAP_BATCH];
+
+  /* Stage 1: index slots. */
+  for (size_t i = 0; i < n; ++i)
+    __builtin_prefetch((char*)map->index + (hashes[i] & (map->cap - 1)) * width);
+
+  /* Stage 2: entries referred by the home slots. */
+  for (size_t i = 0; i < n; ++i)
+  {
+    ixs[i] = idx_get(map, hashes[i] & (map->cap - 1));
+    if (ixs[i] < IDX_DUMMY)
+      __builtin_prefetch(map->entries + ixs[i]);
+  }
+
+  /* Stage 3: keys of the entries with matching hash. */
+  if (strkeys)
+  {
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (ixs[i] < IDX_DUMMY)
+        prefetch_keys(map, map->entries + ixs[i], 1, hashes[i]);
+    }
+  }
+
+  /* Stage 4: compare. */
+  for (size_t i = 0; i < n; ++i)
+    out[i] = ord_find(map, keys[i], key_len(map, keys[i]), hashes[i]);
+}
+
+void
+cod_hash_map_find_batch(const cod_hash_map *map, const char *const *keys,
+    const uint32_t *hashes, size_t n, cod_hash_map_elt **out)
+{
+  for (size_t i = 0; i < n; i += COD_HASH_MAP_BATCH)
+  {
+    size_t m = n - i < COD_HASH_MAP_BATCH ? n - i : COD_HASH_MAP_BATCH;
+    if (map->flags & COD_HASH_MAP_ORDERED)
+      find_batch_ordered(map, keys + i, hashes + i, m, out + i);
+    else if (map->flags & COD_HASH_MAP_FLAT)
+      find_batch_flat(map, keys + i, hashes + i, m, out + i);
+    else
+      find_batch_chain(map, keys + i, hashes + i, m, out + i);
+  }
+}
+
+/* Move elements of an old bucket into the current table. */
+static void
+migrate_bucket(cod_hash_map *map, cod_bucket *oldbuck)
+{
+  for (size_t ielt = 0; ielt < oldbuck->len; ++ielt)
+  {
+    cod_hash_map_elt *elt = oldbuck->data + ielt;
+    cod_bucket *buck = map->data + (elt->hash & (map->cap - 1));
+    cod_vec_push_with(*buck, map->allocator, *elt);
+  }
+  cod_vec_destroy_with(*oldbuck, map->allocator);
+}
+
+static void
+rehash(cod_hash_map *map, size_t newcap)
+{
+  size_t oldcap = map->cap;
+  cod_bucket *olddata = map->data;
+  STAT_TIMER(t);
+
+  map->cap = newcap;
+  map->data = cod_calloc_with(map->allocator, newcap, sizeof(cod_bucket));
+
+  for (size_t ibuck = 0; ibuck < oldcap; ++ibuck)
+  {
+    cod_bucket *buck = olddata + ibuck;
+    if (buck->data)
+      migrate_bucket(map, buck);
+  }
+  free_table(map, olddata);
+  STAT_ADD(map, rehashes, 1);
+  STAT_REHASH_DONE(map, t);
+}
+
+/* Migrate up to `n` non-empty buckets of the old table (visiting at most
+ * 10*n empty ones), and release the old table when done. */
+static void
+rehash_step(cod_hash_map *map, size_t n)
+{
+  size_t empty_visits = n * 10;
+  STAT_TIMER(t);
+  while (n > 0 && map->rehashidx < map->oldcap)
+  {
+    cod_bucket *oldbuck = map->olddata + map->rehashidx++;
+    if (oldbuck->data == NULL)
+    {
+      if (--empty_visits == 0)
+        break;
+      continue;
+    }
+    migrate_bucket(map, oldbuck);
+    n -= 1;
+  }
+
+  if (map->rehashidx == map->oldcap)
+  {
+    free_table(map, map->olddata);
+    map->olddata = NULL;
+    map->oldcap = 0;
+    map->rehashidx = 0;
+  }
+  STAT_REHASH_DONE(map, t);
+}
+
+static void
+finish_rehash(cod_hash_map *map)
+{
+  while (map->olddata)
+    rehash_step(map, map->oldcap);
+}
+
+/* Allocate new table and leave the old one for incremental migration. */
+static void
+start_rehash(cod_hash_map *map, size_t newcap)
+{
+  /* Table outgrew itself before previous rehash finished. */
+  finish_rehash(map);
+
+  map->olddata = map->data;
+  map->oldcap = map->cap;
+  map->rehashidx = 0;
+  map->data = cod_calloc_with(map->allocator, newcap, sizeof(cod_bucket));
+  map->cap = newcap;
+  STAT_ADD(map, rehashes, 1);
+}
+
+static cod_hash_map_elt*
+raw_insert(cod_hash_map *map, const char *key, size_t len, size_t hash,
+    void (*dtor)(void*), int *isnew)
+{
+  if (map->flags & COD_HASH_MAP_ORDERED)
+    return ord_raw_insert(map, key, len, hash, dtor, isnew);
+  if (map->flags & COD_HASH_MAP_FLAT)
+    return flat_raw_insert(map, key, len, hash, dtor, isnew);
+
+  if (map->olddata)
+    rehash_step(map, COD_HASH_MAP_REHASH_STEP);
+
+  cod_bucket *buck;
+  cod_hash_map_elt *elt = find(map, key, len, hash, &buck);
+  if (elt)
+  {
+    if (dtor == NULL) return NULL;
+    dtor(elt->val);
+    *isnew = 0;
+    return elt;
+  }
+  else
+  {
+    if (map->cap == 1)
+    {
+      /* Small map: a single array until it holds COD_HASH_MAP_SMALL elements,
+       * then it is switched to a regular table (at once, as it is tiny). */
+      if (map->size >= COD_HASH_MAP_SMALL)
+      {
+        rehash(map, capacity_for(map->flags, COD_HASH_MAP_SMALL * 2));
+        buck = map->data + (hash & (map->cap - 1));
+      }
+      else if (buck->data == NULL)
+      {
+        cod_vec_init_cap_with(*buck, map->allocator, COD_HASH_MAP_SMALL);
+      }
+    }
+    else if ((map->size >> (cod_log2_u64(map->cap) - 1)) > 2)
+    {
+      if (map->flags & COD_HASH_MAP_INCREMENTAL)
+      {
+        start_rehash(map, map->cap << 1);
+        buck = map->data + (hash & (map->cap - 1));
+      }
+      else
+      {
+        rehash(map, map->cap << 1);
+        buck = map->data + (hash & (map->cap - 1));
+      }
+    }
+
+    cod_hash_map_elt newelt = { 0 };
+    cod_vec_push_with(*buck, map->allocator, newelt);
+    map->size += 1;
+    *isnew = 1;
+    return &cod_vec_last(*buck);
+  }
+}
+
+/* Fill in the key of a new element. */
+static inline void
+init_key(cod_hash_map *map, cod_hash_map_elt *elt, const char *key, size_t len,
+    uint32_t hash)
+{
+  if (map->flags & COD_HASH_MAP_INTKEYS)
+    elt->key = (char*)key;
+  else
+    elt->key = copy_key(map, key, len);
+  elt->klen = len;
+  elt->hash = hash;
+}
+
+int
+cod_hash_map_insert_n(cod_hash_map *map, const void *key, size_t len,
+    size_t hash, void *val, void (*dtor)(void*))
+{
+  assert(len < UINT32_MAX);
+  int isnew;
+  cod_hash_map_elt *elt = raw_insert(map, key, len, hash, dtor, &isnew);
+  if (elt == NULL) return 0;
+
+  /* Equal key is already there in case of replacement. */
+  if (isnew)
+    init_key(map, elt, key, len, hash);
+  elt->val = val;
+  return 1;
+}
+
+int
+cod_hash_map_insert(cod_hash_map *map, const char *key, size_t hash, void *val,
+    void (*dtor)(void*))
+{ return cod_hash_map_insert_n(map, key, key_len(map, key), hash, val, dtor); }
+
+cod_hash_map_elt*
+cod_hash_map_entry_n(cod_hash_map *map, const void *key, size_t len,
+    uint32_t hash, int *inserted)
+{
+  assert(len < UINT32_MAX);
+  int isnew;
+  /* Dummy destructor makes raw_insert() return existing element. */
+  cod_hash_map_elt *elt = raw_insert(map, key, len, hash, cod_dummy_dtor, &isnew);
+  if (isnew)
+  {
+    init_key(map, elt, key, len, hash);
+    elt->val = NULL;
+  }
+  if (inserted)
+    *inserted = isnew;
+  return elt;
+}
+
+cod_hash_map_elt*
+cod_hash_map_entry(cod_hash_map *map, const char *key, uint32_t hash,
+    int *inserted)
+{ return cod_hash_map_entry_n(map, key, key_len(map, key), hash, inserted); }
+
+int
+cod_hash_map_upsert_n(cod_hash_map *map, const void *key, size_t len,
+    uint32_t hash, void *val, void* (*merge)(void *old, void *val))
+{
+  int inserted;
+  cod_hash_map_elt *elt = cod_hash_map_entry_n(map, key, len, hash, &inserted);
+  elt->val = inserted ? val : merge(elt->val, val);
+  return inserted;
+}
+
+int
+cod_hash_map_upsert(cod_hash_map *map, const char *key, uint32_t hash,
+    void *val, void* (*merge)(void *old, void *val))
+{ return cod_hash_map_upsert_n(map, key, key_len(map, key), hash, val, merge); }
+
+int
+cod_hash_map_insert_drain(cod_hash_map *map, char *key, size_t hash, void *val,
+    void (*dtor)(void*))
+{
+  size_t len = key_len(map, key);
+  int isnew;
+  cod_hash_map_elt *elt = raw_insert(map, key, len, hash, dtor, &isnew);
+  if (elt == NULL) return 0;
+
+  if (isnew && !(map->flags & COD_HASH_MAP_KEY_ARENA))
+  {
+    elt->key = key;
+  }
+  else
+  {
+    if (isnew)
+      elt->key = copy_key(map, key, len);
+    if (!(map->flags & COD_HASH_MAP_INTKEYS))
+      cod_free_with(map->allocator, key);
+  }
+  if (isnew)
+    elt->klen = len;
+  elt->hash = hash;
+  elt->val = val;
+  return 1;
+}
+
+void
+cod_hash_map_reserve(cod_hash_map *map, size_t n)
+{
+  size_t cap = capacity_for(map->flags, n);
+  if (cap <= map->cap)
+    return;
+
+  if (map->flags & COD_HASH_MAP_ORDERED)
+  {
+    ord_rebuild(map, cap);
+  }
+  else if (map->flags & COD_HASH_MAP_FLAT)
+  {
+    flat_rehash(map, cap);
+  }
+  else
+  {
+    finish_rehash(map);
+    rehash(map, cap);
+  }
+}
+
+/* Bucket (or first probe group for COD_HASH_MAP_FLAT, or index slot for
+ * COD_HASH_MAP_ORDERED) of the hash. */
+static inline size_t
+home_index(const cod_hash_map *map, uint32_t hash)
+{
+  if (map->flags & COD_HASH_MAP_FLAT)
+    return GROUP_INDEX(hash) & (map->cap / GROUP_WIDTH - 1);
+  else
+    return hash & (map->cap - 1);
+}
+
+cod_hash_map*
+cod_hash_map_build(int flags, const char *const *keys, const uint32_t *hashes,
+    void *const *vals, size_t n)
+{
+  /* Input order is the order of elements with COD_HASH_MAP_ORDERED, so it
+   * can't be partitioned. */
+  if (flags & COD_HASH_MAP_ORDERED)
+    flags &= ~(COD_HASH_MAP_FLAT | COD_HASH_MAP_PARTITION);
+
+  cod_hash_map *map = cod_hash_map_new_with_capacity(flags, n);
+  const int chained = !(flags & (COD_HASH_MAP_FLAT | COD_HASH_MAP_ORDERED));
+  const size_t nhomes =
+    flags & COD_HASH_MAP_FLAT ? map->cap / GROUP_WIDTH : map->cap;
+
+  /* Count elements per bucket. It is required to allocate chains of exact
+   * size, and for the partitioning. */
+  size_t *counts = NULL;
+  if (chained || (flags & COD_HASH_MAP_PARTITION))
+  {
+    counts = cod_calloc(nhomes, sizeof(size_t));
+    for (size_t i = 0; i < n; ++i)
+      counts[home_index(map, hashes[i])] += 1;
+  }
+
+  if (chained)
+  {
+    for (size_t ib = 0; ib < nhomes; ++ib)
+    {
+      if (counts[ib])
+      {
+        cod_bucket *buck = map->data + ib;
+        buck->data = cod_alloc_with(map->allocator,
+            sizeof(cod_hash_map_elt) * counts[ib]);
+        buck->cap = counts[ib];
+      }
+    }
+  }
+
+  /* Counting sort of element indices by bucket. */
+  size_t *order = NULL;
+  if (flags & COD_HASH_MAP_PARTITION)
+  {
+    size_t offs = 0;
+    for (size_t ih = 0; ih < nhomes; ++ih)
+    {
+      size_t cnt = counts[ih];
+      counts[ih] = offs;
+      offs += cnt;
+    }
+    order = cod_malloc(sizeof(size_t) * n);
+    for (size_t i = 0; i < n; ++i)
+      order[counts[home_index(map, hashes[i])]++] = i;
+  }
+  cod_free(counts);
+
+  for (size_t j = 0; j < n; ++j)
+  {
+    size_t i = order ? order[j] : j;
+    const char *key = keys[i];
+    uint32_t hash = hashes[i];
+
+    cod_hash_map_elt *elt;
+    if (flags & COD_HASH_MAP_ORDERED)
+    {
+      idx_set(map, ord_find_free(map, hash), map->nentries);
+      elt = map->entries + map->nentries++;
+    }
+    else if (flags & COD_HASH_MAP_FLAT)
+    {
+      size_t islot = flat_find_free(map, hash);
+      map->ctrl[islot] = CTRL_TAG(hash);
+      elt = map->slots + islot;
+    }
+    else
+    {
+      cod_bucket *buck = map->data + (hash & (map->cap - 1));
+      elt = buck->data + buck->len++;
+    }
+
+    if (flags & COD_HASH_MAP_INTKEYS)
+    {
+      elt->key = (char*)key;
+      elt->klen = 0;
+    }
+    else
+    {
+      elt->klen = strlen(key);
+      elt->key = copy_key(map, key, elt->klen);
+    }
+    elt->hash = hash;
+    elt->val = vals ? vals[i] : NULL;
+  }
+  map->size = n;
+
+  cod_free(order);
+  return map;
+}
+
+/* Halve the table once it becomes sparse enough. Thresholds are far below the
+ * growth ones, so that the table doesn't flip between two sizes. */
+static void
+maybe_shrink(cod_hash_map *map)
+{
+  if (!(map->flags & COD_HASH_MAP_AUTOSHRINK))
+    return;
+
+  if (map->flags & COD_HASH_MAP_ORDERED)
+  {
+    /* Below 1/8 of usable entries. */
+    if (map->cap > ORD_MINCAP && map->size * 8 < ORD_USABLE(map->cap))
+      ord_rebuild(map, map->cap >> 1);
+  }
+  else if (map->flags & COD_HASH_MAP_FLAT)
+  {
+    /* Below load factor of 1/8. */
+    if (map->cap > GROUP_WIDTH && map->size * 8 < map->cap)
+      flat_rehash(map, map->cap >> 1);
+  }
+  else
+  {
+    /* Below average chain length of 1/4. */
+    if (map->cap > 1 && map->size * 4 < map->cap && map->olddata == NULL)
+    {
+      if (map->flags & COD_HASH_MAP_INCREMENTAL)
+        start_rehash(map, map->cap >> 1);
+      else
+        rehash(map, map->cap >> 1);
+    }
+  }
+}
+
+void
+cod_hash_map_shrink_to_fit(cod_hash_map *map)
+{
+  size_t cap = capacity_for(map->flags, map->size);
+
+  if (map->flags & COD_HASH_MAP_ORDERED)
+  {
+    /* Also drops the erased entries. */
+    ord_rebuild(map, cap);
+  }
+  else if (map->flags & COD_HASH_MAP_FLAT)
+  {
+    /* Also drops the tombstones. */
+    flat_rehash(map, cap);
+  }
+  else
+  {
+    finish_rehash(map);
+
+    /* Rebuild chains at their exact sizes. */
+    STAT_TIMER(t);
+    cod_bucket *olddata = map->data;
+    size_t oldcap = map->cap;
+    map->cap = cap;
+    map->data = cod_calloc_with(map->allocator, cap, sizeof(cod_bucket));
+    for (size_t ibuck = 0; ibuck < oldcap; ++ibuck)
+    {
+      cod_bucket *buck = olddata + ibuck;
+      for (size_t ielt = 0; ielt < buck->len; ++ielt)
+        map->data[buck->data[ielt].hash & (cap - 1)].cap += 1;
+    }
+    for (size_t ibuck = 0; ibuck < cap; ++ibuck)
+    {
+      cod_bucket *buck = map->data + ibuck;
+      if (buck->cap)
+        buck->data = cod_alloc_with(map->allocator,
+            sizeof(cod_hash_map_elt) * buck->cap);
+    }
+    for (size_t ibuck = 0; ibuck < oldcap; ++ibuck)
+    {
+      cod_bucket *oldbuck = olddata + ibuck;
+      for (size_t ielt = 0; ielt < oldbuck->len; ++ielt)
+      {
+        cod_hash_map_elt *elt = oldbuck->data + ielt;
+        cod_bucket *buck = map->data + (elt->hash & (cap - 1));
+        buck->data[buck->len++] = *elt;
+      }
+      cod_vec_destroy_with(*oldbuck, map->allocator);
+    }
+    free_table(map, olddata);
+    STAT_ADD(map, rehashes, 1);
+    STAT_REHASH_DONE(map, t);
+  }
+
+  if (map->keys_garbage > 0)
+    compact_keys(map);
+}
+
+int
+cod_hash_map_erase_n(cod_hash_map *map, const void *key, size_t len,
+    size_t hash, void (*dtor)(void*))
+{
+  if (dtor == NULL)
+    dtor = cod_dummy_dtor;
+
+  if (map->flags & (COD_HASH_MAP_FLAT | COD_HASH_MAP_ORDERED))
+  {
+    if (map->flags & COD_HASH_MAP_ORDERED)
+    {
+      if (!ord_erase(map, key, len, hash, dtor))
+        return 0;
+    }
+    else if (!flat_erase(map, key, len, hash, dtor))
+    {
+      return 0;
+    }
+    maybe_shrink(map);
+    return 1;
+  }
+
+  if (map->olddata)
+    rehash_step(map, COD_HASH_MAP_REHASH_STEP);
+
+  cod_bucket *buck;
+  cod_hash_map_elt *elt = find(map, key, len, hash, &buck);
+  if (elt)
+  {
+    free_key(map, elt);
+    dtor(elt->val);
+    cod_vec_erase(*buck, elt - buck->data);
+    /* Give back memory of emptied chains. */
+    if (buck->len == 0)
+      cod_vec_destroy_with(*buck, map->allocator);
+    map->size -= 1;
+    maybe_compact_keys(map);
+    maybe_shrink(map);
+    return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+int
+cod_hash_map_erase(cod_hash_map *map, const char *key, size_t hash,
+    void (*dtor)(void*))
+{ return cod_hash_map_erase_n(map, key, key_len(map, key), hash, dtor); }
+
+static void
+relocate_key(cod_hash_map *map, cod_hash_map_elt *elt)
+{
+  size_t n = elt->klen + 1;
+  char *newkey = arena_alloc(map, n);
+  memcpy(newkey, elt->key, n);
+  elt->key = newkey;
+}
+
+static void
+compact_keys(cod_hash_map *map)
+{
+  cod_key_chunk *oldkeys = map->keys;
+  map->keys = new_key_chunk(map, map->keys_live > COD_HASH_MAP_KEY_CHUNK ?
+      map->keys_live : COD_HASH_MAP_KEY_CHUNK);
+  map->keys->next = NULL;
+  map->keys_garbage = 0;
+
+  if (map->flags & COD_HASH_MAP_ORDERED)
+  {
+    for (size_t i = 0; i < map->nentries; ++i)
+    {
+      if (!ORD_ERASED(map->entries + i))
+        relocate_key(map, map->entries + i);
+    }
+  }
+  else if (map->flags & COD_HASH_MAP_FLAT)
+  {
+    for (size_t i = 0; i < map->cap; ++i)
+    {
+      if (map->ctrl[i] >= 0)
+        relocate_key(map, map->slots + i);
+    }
+  }
+  else
+  {
+    for (size_t ibuck = 0; ibuck < map->cap; ++ibuck)
+    {
+      cod_bucket *buck = map->data + ibuck;
+      for (size_t ielt = 0; ielt < buck->len; ++ielt)
+        relocate_key(map, buck->data + ielt);
+    }
+    if (map->olddata)
+    {
+      for (size_t ibuck = map->rehashidx; ibuck < map->oldcap; ++ibuck)
+      {
+        cod_bucket *buck = map->olddata + ibuck;
+        for (size_t ielt = 0; ielt < buck->len; ++ielt)
+          relocate_key(map, buck->data + ielt);
+      }
+    }
+  }
+
+  while (oldkeys)
+  {
+    cod_key_chunk *next = oldkeys->next;
+    cod_free_with(map->allocator, oldkeys);
+    oldkeys = next;
+  }
+}
+
+/* Buckets are enumerated over the current table followed by the old one (if
+ * incremental rehash is in progress). */
+static cod_bucket*
+bucket_at(const cod_hash_map *map, size_t i)
+{
+  if (i < map->cap)
+    return map->data + i;
+  else
+    return map->olddata + (i - map->cap);
+}
+
+static int
+next_bucket(const cod_hash_map *map, int from)
+{
+  size_t nbucks = map->cap + (map->olddata ? map->oldcap : 0);
+  for (size_t i = from; i < nbucks; ++i)
+  {
+    cod_bucket *buck = bucket_at(map, i);
+    if (buck->data && buck->len > 0)
+      return i;
+  }
+  return -1;
+}
+
+void
+cod_hash_map_begin(const cod_hash_map *map, cod_hash_map_iter *iter)
+{
+  if (map->flags & COD_HASH_MAP_ORDERED)
+  {
+    iter->buckidx = ord_next_entry(map, 0);
+    iter->eltidx = 0;
+    return;
+  }
+
+  if (map->flags & COD_HASH_MAP_FLAT)
+  {
+    iter->buckidx = flat_next_slot(map, 0);
+    iter->eltidx = 0;
+    return;
+  }
+
+  int ib = next_bucket(map, 0);
+  iter->buckidx = ib;
+  iter->eltidx = 0;
+}
+
+int
+cod_hash_map_next(const cod_hash_map *map, char **key, void *val,
+    cod_hash_map_iter *iter)
+{
+  if (iter->buckidx < 0)
+    return 0;
+
+  if (map->flags & COD_HASH_MAP_ORDERED)
+  {
+    cod_hash_map_elt *elt = map->entries + iter->buckidx;
+    if (key) *key = elt->key;
+    if (val) *(void**)val = elt->val;
+    iter->buckidx = ord_next_entry(map, iter->buckidx + 1);
+    return 1;
+  }
+
+  if (map->flags & COD_HASH_MAP_FLAT)
+  {
+    cod_hash_map_elt *elt = map->slots + iter->buckidx;
+    if (key) *key = elt->key;
+    if (val) *(void**)val = elt->val;
+    iter->buckidx = flat_next_slot(map, iter->buckidx + 1);
+    return 1;
+  }
+
+  cod_bucket *buck = bucket_at(map, iter->buckidx);
+
+  if (key) *key = buck->data[iter->eltidx].key;
+  if (val) *(void**)val = buck->data[iter->eltidx].val;
+
+  if (++iter->eltidx == (int)buck->len)
+  {
+    iter->buckidx = next_bucket(map, iter->buckidx + 1);
+    iter->eltidx = 0;
+  }
+  return 1;
+}
+
+/******************************************************************************
+ * Statistics
+ */
+/* Gather pointers to all elements, whatever engine the map uses. */
+static const cod_hash_map_elt**
+collect_elts(const cod_hash_map *map)
+{
+  const cod_hash_map_elt **elts = cod_malloc(sizeof(void*) * (map->size + 1));
+  size_t n = 0;
+  if (map->flags & COD_HASH_MAP_ORDERED)
+  {
+    for (size_t i = 0; i < map->nentries; ++i)
+    {
+      if (!ORD_ERASED(map->entries + i))
+        elts[n++] = map->entries + i;
+    }
+  }
+  else if (map->flags & COD_HASH_MAP_FLAT)
+  {
+    for (size_t i = 0; i < map->cap; ++i)
+    {
+      if (map->ctrl[i] >= 0)
+        elts[n++] = map->slots + i;
+    }
+  }
+  else
+  {
+    size_t nbucks = map->cap + (map->olddata ? map->oldcap : 0);
+    for (size_t ib = 0; ib < nbucks; ++ib)
+    {
+      cod_bucket *buck = bucket_at(map, ib);
+      for (size_t ie = 0; ie < buck->len; ++ie)
+        elts[n++] = buck->data + ie;
+    }
+  }
+  assert(n == map->size);
+  return elts;
+}
+
+static size_t
+key_bytes(const cod_hash_map *map)
+{
+  if (map->flags & COD_HASH_MAP_INTKEYS)
+    return 0;
+
+  size_t n = 0;
+  if (map->flags & COD_HASH_MAP_KEY_ARENA)
+  {
+    for (cod_key_chunk *chunk = map->keys; chunk; chunk = chunk->next)
+      n += sizeof(cod_key_chunk) + chunk->cap;
+    return n;
+  }
+
+  const cod_hash_map_elt **elts = collect_elts(map);
+  for (size_t i = 0; i < map->size; ++i)
+    n += elts[i]->klen + 1;
+  cod_free(elts);
+  return n;
+}
+
+void
+cod_hash_map_stats(const cod_hash_map *map, cod_hash_map_stat *stat)
+{
+  memset(stat, 0, sizeof(*stat));
+  stat->size = map->size;
+  stat->cap = map->cap;
+  stat->load_factor = (double)map->size / map->cap;
+  stat->key_bytes = key_bytes(map);
+#ifdef COD_HASH_MAP_STATS
+  stat->counters = map->counters;
+#endif
+
+  size_t total = 0, nonempty = 0;
+  if (map->flags & COD_HASH_MAP_ORDERED)
+  {
+    /* Length of probe sequence needed to reach each element. */
+    for (size_t i = 0; i < map->cap; ++i)
+    {
+      size_t ix = idx_get(map, i);
+      if (ix >= IDX_DUMMY)
+        continue;
+      size_t perturb = map->entries[ix].hash;
+      size_t len = 1;
+      for (size_t j = perturb & (map->cap - 1); j != i;
+           j = ORD_NEXT(j, perturb, map->cap - 1))
+        len += 1;
+      stat->hist[len < COD_HASH_MAP_STAT_HIST ? len : COD_HASH_MAP_STAT_HIST - 1] += 1;
+      if (len > stat->max_chain)
+        stat->max_chain = len;
+      total += len;
+      nonempty += 1;
+    }
+    stat->table_bytes = sizeof(cod_hash_map_elt) * ORD_USABLE(map->cap) +
+      idx_width(map->cap) * map->cap;
+  }
+  else if (map->flags & COD_HASH_MAP_FLAT)
+  {
+    /* Length of probe sequence (in groups) needed to reach each element. */
+    const size_t ngroups = map->cap / GROUP_WIDTH;
+    for (size_t i = 0; i < map->cap; ++i)
+    {
+      if (map->ctrl[i] < 0)
+        continue;
+      size_t g = GROUP_INDEX(map->slots[i].hash) & (ngroups - 1);
+      size_t len = 1;
+      for (size_t step = 1; g != i / GROUP_WIDTH; g = (g + step++) & (ngroups - 1))
+        len += 1;
+      stat->hist[len < COD_HASH_MAP_STAT_HIST ? len : COD_HASH_MAP_STAT_HIST - 1] += 1;
+      if (len > stat->max_chain)
+        stat->max_chain = len;
+      total += len;
+      nonempty += 1;
+    }
+    stat->table_bytes = (sizeof(cod_hash_map_elt) + 1) * map->cap;
+  }
+  else
+  {
+    size_t nbucks = map->cap + (map->olddata ? map->oldcap : 0);
+    stat->table_bytes = sizeof(cod_bucket) * nbucks;
+    for (size_t ib = 0; ib < nbucks; ++ib)
+    {
+      /* Old buckets are already migrated. */
+      if (ib >= map->cap && ib - map->cap < map->rehashidx)
+        continue;
+      cod_bucket *buck = bucket_at(map, ib);
+      size_t len = buck->len;
+      stat->hist[len < COD_HASH_MAP_STAT_HIST ? len : COD_HASH_MAP_STAT_HIST - 1] += 1;
+      if (len > stat->max_chain)
+        stat->max_chain = len;
+      if (len)
+      {
+        total += len;
+        nonempty += 1;
+      }
+      stat->table_bytes += sizeof(cod_hash_map_elt) * buck->cap;
+    }
+  }
+  stat->mean_chain = nonempty ? (double)total / nonempty : 0;
+}
+
+void
+cod_hash_map_reset_stats(cod_hash_map *map)
+{
+#ifdef COD_HASH_MAP_STATS
+  memset(&map->counters, 0, sizeof(map->counters));
+#else
+  (void)map;
+#endif
+}
+
+/******************************************************************************
+ * Snapshots
+ *
+ * File layout (native byte order; all sections are 8-byte aligned):
+ *   header
+ *   uint64_t buckets[nbuckets + 1]
+ *   cod_hash_map_mmap_elt elts[size]
+ *   char keys[keys_size]
+ */
+#define SNAPSHOT_MAGIC "CODHMAP"
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+  char magic[8];
+  uint32_t version; /* also catches foreign byte order */
+  uint32_t flags;
+  uint64_t size, nbuckets;
+  uint64_t buckets_off, elts_off, keys_off, keys_size;
+};
+
+static inline uint64_t
+align8(uint64_t x)
+{ return (x + 7) & ~(uint64_t)7; }
+
+int
+cod_hash_map_save(const cod_hash_map *map, const char *path)
+{
+  const int intkeys = map->flags & COD_HASH_MAP_INTKEYS;
+  const size_t n = map->size;
+  /* Average chain length is at most 1. */
+  const size_t nbuckets = n > 1 ? cod_rndup2_u64(n) : 1;
+
+  /* Counting sort of elements by bucket gives the bucket offsets table. */
+  const cod_hash_map_elt **elts = collect_elts(map);
+  uint64_t *buckets = cod_calloc(nbuckets + 1, sizeof(uint64_t));
+  for (size_t i = 0; i < n; ++i)
+    buckets[(elts[i]->hash & (nbuckets - 1)) + 1] += 1;
+  for (size_t ib = 0; ib < nbuckets; ++ib)
+    buckets[ib + 1] += buckets[ib];
+
+  cod_hash_map_mmap_elt *out = cod_malloc(sizeof(cod_hash_map_mmap_elt) * (n + 1));
+  const cod_hash_map_elt **sorted = cod_malloc(sizeof(void*) * (n + 1));
+  uint64_t *fill = cod_malloc(sizeof(uint64_t) * nbuckets);
+  memcpy(fill, buckets, sizeof(uint64_t) * nbuckets);
+  for (size_t i = 0; i < n; ++i)
+    sorted[fill[elts[i]->hash & (nbuckets - 1)]++] = elts[i];
+  cod_free(fill);
+  cod_free(elts);
+
+  /* Keys are laid out in the same order as elements. */
+  uint64_t keys_size = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    const cod_hash_map_elt *elt = sorted[i];
+    out[i].hash = elt->hash;
+    out[i].klen = elt->klen;
+    out[i].val = (uintptr_t)elt->val;
+    if (intkeys)
+    {
+      out[i].key = (uintptr_t)elt->key;
+    }
+    else
+    {
+      out[i].key = keys_size;
+      keys_size += elt->klen + 1;
+    }
+  }
+
+  struct snapshot_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  hdr.version = SNAPSHOT_VERSION;
+  hdr.flags = intkeys;
+  hdr.size = n;
+  hdr.nbuckets = nbuckets;
+  hdr.buckets_off = align8(sizeof(hdr));
+  hdr.elts_off = hdr.buckets_off + sizeof(uint64_t) * (nbuckets + 1);
+  hdr.keys_off = hdr.elts_off + sizeof(cod_hash_map_mmap_elt) * n;
+  hdr.keys_size = keys_size;
+
+  /* Unique temporary name, so that concurrent saves don't clobber each other's
+   * files. It is made readable like a file created by fopen() would be
+   * (modulo umask), since other processes are going to map it. */
+  char *tmppath = cod_malloc(strlen(path) + 8);
+  sprintf(tmppath, "%s.XXXXXX", path);
+
+  int ok = 0;
+  FILE *file = NULL;
+  int fd = mkstemp(tmppath);
+  if (fd >= 0)
+  {
+    if (fchmod(fd, 0644) < 0 || (file = fdopen(fd, "wb")) == NULL)
+    {
+      int err = errno;
+      close(fd);
+      unlink(tmppath);
+      errno = err;
+    }
+  }
+  if (file)
+  {
+    ok = fwrite(&hdr, sizeof(hdr), 1, file) == 1;
+    ok = ok && fwrite(buckets, sizeof(uint64_t), nbuckets + 1, file) == nbuckets + 1;
+    ok = ok && fwrite(out, sizeof(cod_hash_map_mmap_elt), n, file) == n;
+    for (size_t i = 0; ok && !intkeys && i < n; ++i)
+      ok = fwrite(sorted[i]->key, 1, sorted[i]->klen + 1, file) == sorted[i]->klen + 1;
+    /* Data must be on disk before the rename makes it visible under `path`,
+     * or a crash could leave a truncated snapshot there. */
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+    if (ok)
+      ok = rename(tmppath, path) == 0;
+    if (!ok)
+    {
+      int err = errno;
+      unlink(tmppath);
+      errno = err;
+    }
+  }
+
+  cod_free(tmppath);
+  cod_free(sorted);
+  cod_free(out);
+  cod_free(buckets);
+  return ok ? 0 : -1;
+}
+
+static int
+snapshot_valid(const struct snapshot_header *hdr, size_t mapsize)
+{
+  if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+      hdr->version != SNAPSHOT_VERSION)
+    return 0;
+  if (hdr->nbuckets == 0 || (hdr->nbuckets & (hdr->nbuckets - 1)))
+    return 0;
+  /* Sections must follow each other without overflows. */
+  if (hdr->buckets_off != align8(sizeof(*hdr)) ||
+      hdr->nbuckets > (mapsize - hdr->buckets_off) / sizeof(uint64_t) - 1)
+    return 0;
+  if (hdr->elts_off != hdr->buckets_off + sizeof(uint64_t) * (hdr->nbuckets + 1) ||
+      hdr->size > (mapsize - hdr->elts_off) / sizeof(cod_hash_map_mmap_elt))
+    return 0;
+  if (hdr->keys_off != hdr->elts_off + sizeof(cod_hash_map_mmap_elt) * hdr->size ||
+      hdr->keys_size > mapsize - hdr->keys_off)
+    return 0;
+  return 1;
+}
+
+cod_hash_map_mmap*
+cod_hash_map_open_mmap(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+  {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+  if ((size_t)st.st_size < align8(sizeof(struct snapshot_header)) + sizeof(uint64_t))
+  {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  int err = errno;
+  close(fd);
+  if (base == MAP_FAILED)
+  {
+    errno = err;
+    return NULL;
+  }
+
+  const struct snapshot_header *hdr = base;
+  const uint64_t *buckets = (const uint64_t*)((char*)base + hdr->buckets_off);
+  if (!snapshot_valid(hdr, st.st_size) || buckets[hdr->nbuckets] != hdr->size)
+  {
+    munmap(base, st.st_size);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  cod_hash_map_mmap *map = cod_malloc(sizeof(cod_hash_map_mmap));
+  map->base = base;
+  map->mapsize = st.st_size;
+  map->flags = hdr->flags & COD_HASH_MAP_INTKEYS;
+  map->size = hdr->size;
+  map->nbuckets = hdr->nbuckets;
+  map->buckets = buckets;
+  map->elts = (const cod_hash_map_mmap_elt*)((char*)base + hdr->elts_off);
+  map->keys = (const char*)base + hdr->keys_off;
+  map->keys_size = hdr->keys_size;
+  return map;
+}
+
+void
+cod_hash_map_close_mmap(cod_hash_map_mmap *map)
+{
+  munmap(map->base, map->mapsize);
+  cod_free(map);
+}
+
+const cod_hash_map_mmap_elt*
+cod_hash_map_mmap_find_n(const cod_hash_map_mmap *map, const void *key,
+    size_t len, uint32_t hash)
+{
+  /* Contents of the file are only validated as far as a lookup touches them,
+   * so that opening a snapshot doesn't fault in all of it. Damaged buckets
+   * and keys are never matched. */
+  size_t ib = hash & (map->nbuckets - 1);
+  uint64_t begin = map->buckets[ib], end = map->buckets[ib + 1];
+  if (begin > end || end > map->size)
+    return NULL;
+  for (uint64_t i = begin; i < end; ++i)
+  {
+    const cod_hash_map_mmap_elt *elt = map->elts + i;
+    if (elt->hash != hash)
+      continue;
+    if (map->flags & COD_HASH_MAP_INTKEYS)
+    {
+      if (elt->key == (uintptr_t)key)
+        return elt;
+    }
+    else if (elt->klen == len && elt->key < map->keys_size &&
+        len < map->keys_size - elt->key && map->keys[elt->key + len] == 0 &&
+        memcmp(map->keys + elt->key, key, len) == 0)
+    {
+      return elt;
+    }
+  }
+  return NULL;
+}
+
+const cod_hash_map_mmap_elt*
+cod_hash_map_mmap_find(const cod_hash_map_mmap *map, const char *key,
+    uint32_t hash)
+{
+  size_t len = (map->flags & COD_HASH_MAP_INTKEYS) ? 0 : strlen(key);
+  return cod_hash_map_mmap_find_n(map, key, len, hash);
+}
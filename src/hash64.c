@@ -0,0 +1,285 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * 64-bit non-cryptographic hash.
+ *
+ * Inputs up to 128 bytes are mixed wyhash-style: 64x64->128 bit
+ * multiplications folded into 64 bits, 16 bytes per multiplication, with two
+ * independent lanes. Longer inputs go through an XXH3-style accumulator:
+ * eight 64-bit lanes updated by 32x32->64 bit multiplications per 64-byte
+ * stripe, scrambled every 1024 bytes. The accumulator loop has scalar, SSE2
+ * and AVX2 implementations producing identical results; the best one is
+ * selected at run time.
+ *
+ * sources:
+ *   https://github.com/wangyi-fudan/wyhash
+ *   https://github.com/Cyan4973/xxHash
+ */
+#include "codeine/hash.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HASH64_X86
+#endif
+
+#define STRIPE_LEN 64
+#define STRIPES_PER_BLOCK 16
+#define BLOCK_LEN (STRIPE_LEN * STRIPES_PER_BLOCK)
+#define PRIME32_1 0x9E3779B1u
+
+/* Stripe s of a block uses secret[s .. s + 7]; the last stripe of the input
+ * uses secret[17 .. 24], scrambling uses secret[24 .. 31]. */
+static const uint64_t secret[32] = {
+  0x86b6a8af6007e52full, 0x4ea6e220deb3767aull, 0x18c6c919a5dd8d71ull,
+  0x5ab7b0355a567d35ull, 0x1fc8f39541fc5be1ull, 0x3d1f7256204f81aeull,
+  0x119b0b0dc8af63eeull, 0x34c4d75f27d286aeull, 0xd670d7cf1c864579ull,
+  0xf8ea21229f266910ull, 0x122f2810ff947dd9ull, 0x761b6476729dd7bcull,
+  0xeaa81c31ccaa4469ull, 0xebc6539d4d5acdbbull, 0xc2e39f132173c44cull,
+  0xdc81fc951dd4d413ull, 0x77d2e85c4991ae67ull, 0xf5b0fe6388fa4153ull,
+  0xd0b068f6284ee767ull, 0xc0b403193f28276bull, 0x1ec49326f869a1feull,
+  0x1bcce6843e3ee95full, 0xff2f02373ed67328ull, 0x24ba52912d0e7776ull,
+  0xf80d0acf1298c0c9ull, 0xc3c707b703927f02ull, 0xf2d1387845a11878ull,
+  0x5222a5f4a4cf202cull, 0x7ad0272d124f8c32ull, 0x482d14a46fb297a0ull,
+  0x00b1bb022dc5343aull, 0x2ef2ae9764913a35ull,
+};
+#define LAST_STRIPE_SECRET 17
+#define SCRAMBLE_SECRET 24
+
+static inline uint64_t
+read64(const uint8_t *p)
+{
+  uint64_t x;
+  memcpy(&x, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  x = __builtin_bswap64(x);
+#endif
+  return x;
+}
+
+static inline uint64_t
+read32(const uint8_t *p)
+{
+  uint32_t x;
+  memcpy(&x, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  x = __builtin_bswap32(x);
+#endif
+  return x;
+}
+
+/* 64x64->128 bit multiplication folded into 64 bits. */
+static inline uint64_t
+mix(uint64_t a, uint64_t b)
+{
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+/******************************************************************************
+ * Accumulator loop for long inputs
+ */
+typedef void (*accumulate_fn)(uint64_t acc[8], const uint8_t *p,
+    size_t nstripes, const uint64_t *key);
+
+static void
+accumulate_scalar(uint64_t acc[8], const uint8_t *p, size_t nstripes,
+    const uint64_t *key)
+{
+  for (size_t s = 0; s < nstripes; ++s, p += STRIPE_LEN)
+  {
+    for (int i = 0; i < 8; ++i)
+    {
+      uint64_t val = read64(p + i * 8);
+      uint64_t k = val ^ key[s + i];
+      acc[i ^ 1] += val;
+      acc[i] += (k & 0xFFFFFFFF) * (k >> 32);
+    }
+  }
+}
+
+#if defined(HASH64_X86)
+__attribute__((target("sse2")))
+static void
+accumulate_sse2(uint64_t acc[8], const uint8_t *p, size_t nstripes,
+    const uint64_t *key)
+{
+  __m128i a[4];
+  for (int j = 0; j < 4; ++j)
+    a[j] = _mm_loadu_si128((const __m128i*)acc + j);
+  for (size_t s = 0; s < nstripes; ++s, p += STRIPE_LEN)
+  {
+    for (int j = 0; j < 4; ++j)
+    {
+      __m128i val = _mm_loadu_si128((const __m128i*)p + j);
+      __m128i k = _mm_xor_si128(val, _mm_loadu_si128((const __m128i*)(key + s + 2 * j)));
+      __m128i prod = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+      /* acc[i ^ 1] += val: swap 64-bit halves */
+      __m128i swapped = _mm_shuffle_epi32(val, _MM_SHUFFLE(1, 0, 3, 2));
+      a[j] = _mm_add_epi64(a[j], _mm_add_epi64(prod, swapped));
+    }
+  }
+  for (int j = 0; j < 4; ++j)
+    _mm_storeu_si128((__m128i*)acc + j, a[j]);
+}
+
+__attribute__((target("avx2")))
+static void
+accumulate_avx2(uint64_t acc[8], const uint8_t *p, size_t nstripes,
+    const uint64_t *key)
+{
+  __m256i a[2];
+  for (int j = 0; j < 2; ++j)
+    a[j] = _mm256_loadu_si256((const __m256i*)acc + j);
+  for (size_t s = 0; s < nstripes; ++s, p += STRIPE_LEN)
+  {
+    for (int j = 0; j < 2; ++j)
+    {
+      __m256i val = _mm256_loadu_si256((const __m256i*)p + j);
+      __m256i k = _mm256_xor_si256(val, _mm256_loadu_si256((const __m256i*)(key + s + 4 * j)));
+      __m256i prod = _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32));
+      __m256i swapped = _mm256_shuffle_epi32(val, _MM_SHUFFLE(1, 0, 3, 2));
+      a[j] = _mm256_add_epi64(a[j], _mm256_add_epi64(prod, swapped));
+    }
+  }
+  for (int j = 0; j < 2; ++j)
+    _mm256_storeu_si256((__m256i*)acc + j, a[j]);
+}
+#endif
+
+static void
+accumulate_dispatch(uint64_t acc[8], const uint8_t *p, size_t nstripes,
+    const uint64_t *key);
+
+static accumulate_fn accumulate = accumulate_dispatch;
+
+/* Select implementation on the first call. */
+static void
+accumulate_dispatch(uint64_t acc[8], const uint8_t *p, size_t nstripes,
+    const uint64_t *key)
+{
+  accumulate_fn fn = accumulate_scalar;
+#if defined(HASH64_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    fn = accumulate_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    fn = accumulate_sse2;
+#endif
+  __atomic_store_n(&accumulate, fn, __ATOMIC_RELAXED);
+  fn(acc, p, nstripes, key);
+}
+
+static inline void
+scramble(uint64_t acc[8])
+{
+  for (int i = 0; i < 8; ++i)
+  {
+    uint64_t a = acc[i];
+    a ^= a >> 47;
+    a ^= secret[SCRAMBLE_SECRET + i];
+    acc[i] = a * PRIME32_1;
+  }
+}
+
+static uint64_t
+hash_long(const uint8_t *p, size_t len, uint64_t seed)
+{
+  accumulate_fn acc_fn = __atomic_load_n(&accumulate, __ATOMIC_RELAXED);
+  uint64_t acc[8];
+  for (int i = 0; i < 8; ++i)
+    acc[i] = secret[i] ^ (i & 1 ? seed : -seed);
+
+  size_t nblocks = (len - 1) / BLOCK_LEN;
+  for (size_t b = 0; b < nblocks; ++b)
+  {
+    acc_fn(acc, p + b * BLOCK_LEN, STRIPES_PER_BLOCK, secret);
+    scramble(acc);
+  }
+
+  /* Remaining full stripes, and the last (possibly overlapping) one. */
+  size_t nstripes = (len - 1 - nblocks * BLOCK_LEN) / STRIPE_LEN;
+  acc_fn(acc, p + nblocks * BLOCK_LEN, nstripes, secret);
+  acc_fn(acc, p + len - STRIPE_LEN, 1, secret + LAST_STRIPE_SECRET);
+
+  uint64_t h = len * 0x9E3779B97F4A7C15ull ^ seed;
+  for (int i = 0; i < 8; i += 2)
+    h += mix(acc[i] ^ secret[i + 8], acc[i + 1] ^ secret[i + 9]);
+  return cod_fmix64(h);
+}
+
+uint64_t
+cod_hash64(const void *ptr, size_t len, uint64_t seed)
+{
+  const uint8_t *p = ptr;
+  if (len > 128)
+    return hash_long(p, len, seed);
+
+  const uint64_t s0 = secret[0], s1 = secret[1], s2 = secret[2];
+  uint64_t a, b;
+  seed ^= mix(seed ^ s0, s1);
+  if (len <= 16)
+  {
+    if (len >= 4)
+    {
+      /* Two (possibly overlapping) pairs of 32-bit words cover the input. */
+      size_t off = (len >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + off);
+      b = (read32(p + len - 4) << 32) | read32(p + len - 4 - off);
+    }
+    else if (len > 0)
+    {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    }
+    else
+    {
+      a = b = 0;
+    }
+  }
+  else
+  {
+    size_t i = len;
+    if (i > 32)
+    {
+      /* Two independent lanes of 16 bytes. */
+      uint64_t seed1 = seed;
+      do {
+        seed = mix(read64(p) ^ s1, read64(p + 8) ^ seed);
+        seed1 = mix(read64(p + 16) ^ s2, read64(p + 24) ^ seed1);
+        p += 32;
+        i -= 32;
+      } while (i > 32);
+      seed ^= seed1;
+    }
+    if (i > 16)
+    {
+      seed = mix(read64(p) ^ s1, read64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    /* Last 16 bytes (overlapping the already processed ones). */
+    a = read64(p + i - 16);
+    b = read64(p + i - 8);
+  }
+  a ^= s1;
+  b ^= seed;
+  __uint128_t r = (__uint128_t)a * b;
+  a = (uint64_t)r;
+  b = (uint64_t)(r >> 64);
+  return mix(a ^ s0 ^ len, b ^ s1);
+}
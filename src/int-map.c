@@ -0,0 +1,309 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "codeine/int-map.h"
+#include "codeine/hash.h"
+
+#include <string.h>
+#include <assert.h>
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+#endif
+
+#define MINCAP 8
+
+static inline size_t
+home_slot(const cod_int_map *map, uint64_t key)
+{ return cod_fmix64(key) & (map->cap - 1); }
+
+/* Smallest table size keeping load factor of `n` elements below 3/4. */
+static size_t
+capacity_for(size_t n)
+{
+  size_t cap = cod_rndup2_u64((n * 4 + 2) / 3);
+  return cap < MINCAP ? MINCAP : cap;
+}
+
+static void
+alloc_table(cod_int_map *map, size_t cap)
+{
+  /* Keys and values share single allocation. */
+  map->cap = cap;
+  map->keys = cod_calloc(cap, sizeof(uint64_t) + sizeof(void*));
+  map->vals = (void**)(map->keys + cap);
+}
+
+static void
+rehash(cod_int_map *map, size_t newcap)
+{
+  uint64_t *oldkeys = map->keys;
+  void **oldvals = map->vals;
+  size_t oldcap = map->cap;
+
+  alloc_table(map, newcap);
+  const size_t mask = newcap - 1;
+  for (size_t i = 0; i < oldcap; ++i)
+  {
+    if (oldkeys[i] == 0)
+      continue;
+    size_t j = home_slot(map, oldkeys[i]);
+    while (map->keys[j])
+      j = (j + 1) & mask;
+    map->keys[j] = oldkeys[i];
+    map->vals[j] = oldvals[i];
+  }
+  cod_free(oldkeys);
+}
+
+cod_int_map*
+cod_int_map_new(void)
+{ return cod_int_map_new_with_capacity(0); }
+
+cod_int_map*
+cod_int_map_new_with_capacity(size_t n)
+{
+  cod_int_map *map = cod_malloc(sizeof(cod_int_map));
+  map->size = 0;
+  map->has_zero = 0;
+  map->zero_val = NULL;
+  alloc_table(map, capacity_for(n));
+  return map;
+}
+
+void
+cod_int_map_delete(cod_int_map *map, void (*dtor)(void*))
+{
+  if (dtor)
+  {
+    if (map->has_zero)
+      dtor(map->zero_val);
+    for (size_t i = 0; i < map->cap; ++i)
+    {
+      if (map->keys[i])
+        dtor(map->vals[i]);
+    }
+  }
+  cod_free(map->keys);
+  cod_free(map);
+}
+
+void
+cod_int_map_reserve(cod_int_map *map, size_t n)
+{
+  size_t cap = capacity_for(n);
+  if (cap > map->cap)
+    rehash(map, cap);
+}
+
+/* Slot holding the key, or the empty slot ending its probe sequence. */
+static inline size_t
+find_slot(const cod_int_map *map, uint64_t key)
+{
+  const size_t mask = map->cap - 1;
+  size_t i = home_slot(map, key);
+  while (map->keys[i] != key && map->keys[i] != 0)
+    i = (i + 1) & mask;
+  return i;
+}
+
+int
+cod_int_map_insert(cod_int_map *map, uint64_t key, void *val,
+    void (*dtor)(void*))
+{
+  if (key == 0)
+  {
+    if (map->has_zero)
+    {
+      if (dtor == NULL) return 0;
+      dtor(map->zero_val);
+    }
+    else
+    {
+      map->has_zero = 1;
+      map->size += 1;
+    }
+    map->zero_val = val;
+    return 1;
+  }
+
+  size_t i = find_slot(map, key);
+  if (map->keys[i] == key)
+  {
+    if (dtor == NULL) return 0;
+    dtor(map->vals[i]);
+    map->vals[i] = val;
+    return 1;
+  }
+
+  size_t used = map->size - map->has_zero;
+  if ((used + 1) * 4 > map->cap * 3)
+  {
+    rehash(map, map->cap << 1);
+    i = find_slot(map, key);
+  }
+  map->keys[i] = key;
+  map->vals[i] = val;
+  map->size += 1;
+  return 1;
+}
+
+int
+cod_int_map_erase(cod_int_map *map, uint64_t key, void (*dtor)(void*))
+{
+  if (key == 0)
+  {
+    if (!map->has_zero)
+      return 0;
+    if (dtor) dtor(map->zero_val);
+    map->has_zero = 0;
+    map->zero_val = NULL;
+    map->size -= 1;
+    return 1;
+  }
+
+  size_t i = find_slot(map, key);
+  if (map->keys[i] == 0)
+    return 0;
+  if (dtor) dtor(map->vals[i]);
+
+  /* Shift back the following elements of the cluster which probe sequences
+   * pass through the freed slot. */
+  const size_t mask = map->cap - 1;
+  for (size_t j = (i + 1) & mask; map->keys[j]; j = (j + 1) & mask)
+  {
+    size_t h = home_slot(map, map->keys[j]);
+    if (((j - h) & mask) >= ((j - i) & mask))
+    {
+      map->keys[i] = map->keys[j];
+      map->vals[i] = map->vals[j];
+      i = j;
+    }
+  }
+  map->keys[i] = 0;
+  map->size -= 1;
+  return 1;
+}
+
+void**
+cod_int_map_find(const cod_int_map *map, uint64_t key)
+{
+  if (key == 0)
+    return map->has_zero ? (void**)&map->zero_val : NULL;
+
+  size_t i = find_slot(map, key);
+  return map->keys[i] ? map->vals + i : NULL;
+}
+
+/* Probe starting from the home slot `i`; returns SIZE_MAX if not found. */
+static inline size_t
+probe(const cod_int_map *map, uint64_t key, size_t i)
+{
+  const size_t mask = map->cap - 1;
+#if defined(__AVX2__)
+  const __m256i vkey = _mm256_set1_epi64x(key);
+  const __m256i vzero = _mm256_setzero_si256();
+  /* Compare four slots at a time while they don't wrap around the table. */
+  while (i + 4 <= map->cap)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(map->keys + i));
+    unsigned eq = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, vkey)));
+    unsigned z = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, vzero)));
+    /* Key can't be met after an empty slot. */
+    if (eq && (z == 0 || __builtin_ctz(eq) < __builtin_ctz(z)))
+      return i + __builtin_ctz(eq);
+    if (z)
+      return SIZE_MAX;
+    i += 4;
+  }
+  i &= mask;
+#endif
+  for (;; i = (i + 1) & mask)
+  {
+    if (map->keys[i] == key)
+      return i;
+    if (map->keys[i] == 0)
+      return SIZE_MAX;
+  }
+}
+
+size_t
+cod_int_map_find_batch(const cod_int_map *map, const uint64_t *keys, size_t n,
+    void **out)
+{
+  size_t nfound = 0;
+  size_t slots[COD_INT_MAP_BATCH];
+  for (size_t b = 0; b < n; b += COD_INT_MAP_BATCH)
+  {
+    size_t m = n - b < COD_INT_MAP_BATCH ? n - b : COD_INT_MAP_BATCH;
+
+    /* Stage 1: hash the keys and prefetch their home slots. */
+    for (size_t i = 0; i < m; ++i)
+    {
+      slots[i] = home_slot(map, keys[b + i]);
+      __builtin_prefetch(map->keys + slots[i]);
+      __builtin_prefetch(map->vals + slots[i]);
+    }
+
+    /* Stage 2: probe. */
+    for (size_t i = 0; i < m; ++i)
+    {
+      uint64_t key = keys[b + i];
+      void **val;
+      if (key == 0)
+      {
+        val = map->has_zero ? (void**)&map->zero_val : NULL;
+      }
+      else
+      {
+        size_t j = probe(map, key, slots[i]);
+        val = j == SIZE_MAX ? NULL : map->vals + j;
+      }
+      out[b + i] = val ? *val : NULL;
+      nfound += val != NULL;
+    }
+  }
+  return nfound;
+}
+
+int
+cod_int_map_next(const cod_int_map *map, size_t *iter, uint64_t *key,
+    void **val)
+{
+  /* 0 stands for key 0, and i > 0 for slot i - 1. */
+  if (*iter == 0)
+  {
+    *iter = 1;
+    if (map->has_zero)
+    {
+      if (key) *key = 0;
+      if (val) *val = map->zero_val;
+      return 1;
+    }
+  }
+
+  for (size_t i = *iter - 1; i < map->cap; ++i)
+  {
+    if (map->keys[i])
+    {
+      if (key) *key = map->keys[i];
+      if (val) *val = map->vals[i];
+      *iter = i + 2;
+      return 1;
+    }
+  }
+  *iter = map->cap + 1;
+  return 0;
+}
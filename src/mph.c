@@ -0,0 +1,381 @@
+/* Copyright (C) 2020  Ivan Pidhurskyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "codeine/mph.h"
+
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#define MAX_PILOT 0xFFFF
+#define MAX_SEEDS 64
+#define PILOT_SALT 0x9e3779b97f4a7c15ull
+#define POS_MUL 0xc4ceb9fe1a85ec53ull
+
+/* About 2% of spare positions keep the search for the last buckets short. */
+static inline size_t
+tabsize_for(size_t n)
+{ return n + n / 50 + 1; }
+
+/* Map `x` into [0, n) (by the high bits of `x`). */
+static inline size_t
+fastrange(uint64_t x, size_t n)
+{ return ((__uint128_t)x * n) >> 64; }
+
+/* The bucket is taken from high bits of the hash, so the position is taken
+ * mostly from the low ones. Multiplication after XOR with the pilot's hash
+ * makes the positions of keys of one bucket change relative to each other, not
+ * only get permuted. */
+static inline size_t
+position(uint64_t h, uint16_t pilot, size_t tabsize)
+{
+  uint64_t x = ((h << 32 | h >> 32) ^ cod_fmix64(pilot + PILOT_SALT)) * POS_MUL;
+  return fastrange(x, tabsize);
+}
+
+/* Find pilots for the given seed, and write position of every key into `pos`.
+ * Returns 1 on success, 0 if another seed should be tried, and -1 if some key
+ * is repeated. */
+static int
+search_pilots(cod_mph *mph, const void *const *keys, const size_t *lens,
+    const uint64_t *hashes, size_t *pos)
+{
+  const size_t n = mph->size, nb = mph->nbuckets, t = mph->tabsize;
+  int ret = 0;
+
+  /* Group keys by bucket. */
+  size_t *boff = cod_calloc(nb + 1, sizeof(size_t));
+  size_t *order = cod_malloc(sizeof(size_t) * n);
+  for (size_t i = 0; i < n; ++i)
+    boff[fastrange(hashes[i], nb) + 1] += 1;
+  size_t maxsize = 0;
+  for (size_t b = 0; b < nb; ++b)
+  {
+    if (boff[b + 1] > maxsize)
+      maxsize = boff[b + 1];
+    boff[b + 1] += boff[b];
+  }
+  size_t *fill = cod_malloc(sizeof(size_t) * nb);
+  memcpy(fill, boff, sizeof(size_t) * nb);
+  for (size_t i = 0; i < n; ++i)
+    order[fill[fastrange(hashes[i], nb)]++] = i;
+
+  /* Equal hashes can't be separated by any pilot. */
+  for (size_t b = 0; b < nb; ++b)
+  {
+    for (size_t j = boff[b]; j < boff[b + 1]; ++j)
+    {
+      for (size_t k = boff[b]; k < j; ++k)
+      {
+        size_t x = order[j], y = order[k];
+        if (hashes[x] != hashes[y])
+          continue;
+        if (lens[x] == lens[y] && memcmp(keys[x], keys[y], lens[x]) == 0)
+          ret = -1;
+        goto done;
+      }
+    }
+  }
+
+  /* Largest buckets are placed first, while the table is still empty. */
+  size_t *bysize = cod_calloc(maxsize + 2, sizeof(size_t));
+  size_t *buckets = cod_malloc(sizeof(size_t) * nb);
+  for (size_t b = 0; b < nb; ++b)
+    bysize[maxsize - (boff[b + 1] - boff[b]) + 1] += 1;
+  for (size_t s = 0; s <= maxsize; ++s)
+    bysize[s + 1] += bysize[s];
+  for (size_t b = 0; b < nb; ++b)
+    buckets[bysize[maxsize - (boff[b + 1] - boff[b])]++] = b;
+  cod_free(bysize);
+
+  uint8_t *taken = cod_calloc(t, 1);
+  ret = 1;
+  for (size_t ib = 0; ib < nb && ret == 1; ++ib)
+  {
+    const size_t b = buckets[ib];
+    if (boff[b] == boff[b + 1])
+      break;
+
+    ret = 0;
+    for (uint32_t p = 0; p <= MAX_PILOT; ++p)
+    {
+      size_t j;
+      for (j = boff[b]; j < boff[b + 1]; ++j)
+      {
+        size_t i = order[j];
+        pos[i] = position(hashes[i], p, t);
+        if (taken[pos[i]])
+          break;
+        taken[pos[i]] = 1;
+      }
+      if (j == boff[b + 1])
+      {
+        mph->pilots[b] = p;
+        ret = 1;
+        break;
+      }
+      while (j-- > boff[b])
+        taken[pos[order[j]]] = 0;
+    }
+  }
+  cod_free(taken);
+  cod_free(buckets);
+
+done:
+  cod_free(fill);
+  cod_free(order);
+  cod_free(boff);
+  return ret;
+}
+
+cod_mph*
+cod_mph_build(const void *const *keys, const size_t *lens, void *const *vals,
+    size_t n)
+{
+  uint64_t keys_size = 0;
+  for (size_t i = 0; i < n; ++i)
+    keys_size += lens[i] + 1;
+  if (keys_size > UINT32_MAX)
+  {
+    errno = EOVERFLOW;
+    return NULL;
+  }
+
+  cod_mph *mph = cod_malloc(sizeof(cod_mph));
+  mph->size = n;
+  mph->tabsize = n ? tabsize_for(n) : 0;
+  mph->nbuckets = (n + COD_MPH_BUCKET - 1) / COD_MPH_BUCKET;
+  mph->pilots = cod_calloc(mph->nbuckets + 1, sizeof(uint16_t));
+  mph->remap = cod_calloc(mph->tabsize - n + 1, sizeof(uint32_t));
+  mph->koff = cod_malloc(sizeof(uint32_t) * (n + 1));
+  mph->ids = cod_malloc(sizeof(uint32_t) * (n + 1));
+  mph->keys = cod_malloc(keys_size + 1);
+  mph->vals = cod_malloc(sizeof(void*) * (n + 1));
+
+  uint64_t *hashes = cod_malloc(sizeof(uint64_t) * (n + 1));
+  size_t *pos = cod_malloc(sizeof(size_t) * (n + 1));
+  int ret = 1;
+  for (mph->seed = 0; mph->seed < MAX_SEEDS; ++mph->seed)
+  {
+    for (size_t i = 0; i < n; ++i)
+      hashes[i] = cod_hash64(keys[i], lens[i], mph->seed);
+    memset(mph->pilots, 0, sizeof(uint16_t) * mph->nbuckets);
+    if ((ret = search_pilots(mph, keys, lens, hashes, pos)) != 0)
+      break;
+  }
+  cod_free(hashes);
+
+  if (ret != 1)
+  {
+    /* Failing with all seeds is not expected to happen in practice. */
+    errno = ret < 0 ? EEXIST : EAGAIN;
+    cod_free(pos);
+    cod_mph_delete(mph, NULL);
+    return NULL;
+  }
+
+  /* Positions past the last slot are redirected to the unused slots. */
+  uint8_t *used = cod_calloc(n + 1, 1);
+  for (size_t i = 0; i < n; ++i)
+  {
+    if (pos[i] < n)
+      used[pos[i]] = 1;
+  }
+  size_t hole = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    if (pos[i] < n)
+      continue;
+    while (used[hole])
+      hole += 1;
+    used[hole] = 1;
+    mph->remap[pos[i] - n] = hole;
+    pos[i] = hole;
+  }
+  cod_free(used);
+
+  /* Lay out keys and values by slot. */
+  for (size_t i = 0; i < n; ++i)
+  {
+    mph->ids[pos[i]] = i;
+    mph->vals[pos[i]] = vals ? vals[i] : NULL;
+  }
+  uint32_t off = 0;
+  for (size_t s = 0; s < n; ++s)
+  {
+    size_t i = mph->ids[s];
+    mph->koff[s] = off;
+    memcpy(mph->keys + off, keys[i], lens[i]);
+    mph->keys[off + lens[i]] = 0;
+    off += lens[i] + 1;
+  }
+  mph->koff[n] = off;
+  cod_free(pos);
+  return mph;
+}
+
+cod_mph*
+cod_mph_from_hash_map(const cod_hash_map *map)
+{
+  if (map->flags & COD_HASH_MAP_INTKEYS)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  const size_t n = map->size;
+  const void **keys = cod_malloc(sizeof(void*) * (n + 1));
+  size_t *lens = cod_malloc(sizeof(size_t) * (n + 1));
+  void **vals = cod_malloc(sizeof(void*) * (n + 1));
+  cod_hash_map_iter iter;
+  char *key;
+  void *val;
+  size_t i = 0;
+  cod_hash_map_begin(map, &iter);
+  while (cod_hash_map_next(map, &key, &val, &iter))
+  {
+    keys[i] = key;
+    lens[i] = strlen(key);
+    vals[i] = val;
+    i += 1;
+  }
+
+  cod_mph *mph = cod_mph_build(keys, lens, vals, i);
+  cod_free(keys);
+  cod_free(lens);
+  cod_free(vals);
+  return mph;
+}
+
+void
+cod_mph_delete(cod_mph *mph, void (*dtor)(void*))
+{
+  if (dtor)
+  {
+    for (size_t i = 0; i < mph->size; ++i)
+      dtor(mph->vals[i]);
+  }
+  cod_free(mph->pilots);
+  cod_free(mph->remap);
+  cod_free(mph->koff);
+  cod_free(mph->ids);
+  cod_free(mph->keys);
+  cod_free(mph->vals);
+  cod_free(mph);
+}
+
+long
+cod_mph_slot(const cod_mph *mph, const void *key, size_t len)
+{
+  if (cod_unlikely(mph->size == 0))
+    return -1;
+
+  const uint64_t h = cod_hash64(key, len, mph->seed);
+  const uint16_t pilot = mph->pilots[fastrange(h, mph->nbuckets)];
+  size_t i = position(h, pilot, mph->tabsize);
+  if (i >= mph->size)
+    i = mph->remap[i - mph->size];
+
+  const uint32_t off = mph->koff[i];
+  if (mph->koff[i + 1] - off - 1 != len || memcmp(mph->keys + off, key, len))
+    return -1;
+  return i;
+}
+
+/******************************************************************************
+ * C source emission
+ */
+static void
+emit_u32_array(FILE *out, const char *name, const char *suffix,
+    const uint32_t *a, size_t n)
+{
+  fprintf(out, "static const uint32_t %s_%s[%zu] = {", name, suffix,
+      n ? n : 1);
+  for (size_t i = 0; i < n; ++i)
+    fprintf(out, "%s%" PRIu32 ",", i % 8 ? " " : "\n  ", a[i]);
+  fprintf(out, n ? "\n};\n\n" : " 0 };\n\n");
+}
+
+int
+cod_mph_emit_c(const cod_mph *mph, FILE *out, const char *name)
+{
+  const size_t n = mph->size;
+
+  fprintf(out, "/* Generated by cod_mph_emit_c(); do not edit. */\n");
+  fprintf(out, "#include \"codeine/hash.h\"\n\n#include <string.h>\n\n");
+
+  fprintf(out, "static const uint16_t %s_pilots[%zu] = {", name,
+      mph->nbuckets ? mph->nbuckets : 1);
+  for (size_t b = 0; b < mph->nbuckets; ++b)
+    fprintf(out, "%s%u,", b % 12 ? " " : "\n  ", mph->pilots[b]);
+  fprintf(out, mph->nbuckets ? "\n};\n\n" : " 0 };\n\n");
+
+  emit_u32_array(out, name, "remap", mph->remap, mph->tabsize - n);
+  emit_u32_array(out, name, "koff", mph->koff, n + 1);
+  emit_u32_array(out, name, "ids", mph->ids, n);
+
+  /* One key per line; octal escapes are always 3 digits long, so they can't
+   * swallow a following digit. */
+  fprintf(out, "static const char %s_keys[] =", name);
+  for (size_t s = 0; s < n; ++s)
+  {
+    fprintf(out, "\n  \"");
+    const char *key = cod_mph_key(mph, s);
+    const size_t len = mph->koff[s + 1] - mph->koff[s] - 1;
+    for (size_t k = 0; k < len; ++k)
+    {
+      unsigned char c = key[k];
+      if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\' || c == '?')
+        fprintf(out, "\\%03o", c);
+      else
+        fputc(c, out);
+    }
+    fprintf(out, "\\000\"");
+  }
+  fprintf(out, n ? ";\n\n" : " \"\";\n\n");
+
+  fprintf(out, "long\n%s_index(const void *key, size_t len)\n{\n", name);
+  if (n == 0)
+  {
+    fprintf(out, "  (void)key;\n  (void)len;\n  return -1;\n}\n");
+  }
+  else
+  {
+    fprintf(out,
+        "  const uint64_t h = cod_hash64(key, len, %" PRIu64 "u);\n"
+        "  const size_t b = ((__uint128_t)h * %zuu) >> 64;\n"
+        "  const uint64_t x = ((h << 32 | h >> 32) ^\n"
+        "      cod_fmix64(%s_pilots[b] + 0x%" PRIx64 "ull)) * 0x%" PRIx64 "ull;\n"
+        "  size_t i = ((__uint128_t)x * %zuu) >> 64;\n"
+        "  if (i >= %zu)\n"
+        "    i = %s_remap[i - %zu];\n"
+        "  const uint32_t off = %s_koff[i];\n"
+        "  if (%s_koff[i + 1] - off - 1 != len ||\n"
+        "      memcmp(%s_keys + off, key, len))\n"
+        "    return -1;\n"
+        "  return %s_ids[i];\n"
+        "}\n",
+        mph->seed, mph->nbuckets, name, (uint64_t)PILOT_SALT, (uint64_t)POS_MUL,
+        mph->tabsize, n, name, n, name, name, name, name);
+  }
+
+  if (ferror(out))
+  {
+    if (errno == 0)
+      errno = EIO;
+    return -1;
+  }
+  return 0;
+}
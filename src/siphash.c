@@ -95,3 +95,310 @@ cod_halfsiphash(const uint8_t key[16], const uint8_t *m, size_t len)
   SIPROUND;
   return v1 ^ v3;
 }
+
+/******************************************************************************
+ * Incremental interface
+ */
+void
+cod_halfsiphash_init(cod_halfsiphash_state *st, const uint8_t key[16])
+{
+  uint32_t k0 = U8TO32_LE(key);
+  uint32_t k1 = U8TO32_LE(key + 8);
+  st->v[0] = k0;
+  st->v[1] = k1;
+  st->v[2] = 0x6c796765 ^ k0;
+  st->v[3] = 0x74656462 ^ k1;
+  st->tail = 0;
+  st->len = 0;
+}
+
+void
+cod_halfsiphash_update(cod_halfsiphash_state *st, const void *ptr, size_t len)
+{
+  const uint8_t *m = ptr;
+  uint32_t v0 = st->v[0], v1 = st->v[1], v2 = st->v[2], v3 = st->v[3];
+  uint32_t mi;
+  int ntail = st->len & 3;
+  st->len += len;
+
+  /* Complete the partial word left from the previous call. */
+  if (ntail)
+  {
+    for (; ntail < 4 && len; ++ntail, --len)
+      st->tail |= ((uint32_t)*m++) << (ntail * 8);
+    if (ntail < 4)
+      return;
+    mi = st->tail;
+    st->tail = 0;
+    v3 ^= mi;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= mi;
+  }
+
+  const uint8_t *end = m + len - (len % sizeof(uint32_t));
+  for (; m != end; m += 4) {
+    mi = U8TO32_LE(m);
+    v3 ^= mi;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= mi;
+  }
+
+  for (ntail = 0; ntail < (int)(len & 3); ++ntail)
+    st->tail |= ((uint32_t)m[ntail]) << (ntail * 8);
+
+  st->v[0] = v0; st->v[1] = v1; st->v[2] = v2; st->v[3] = v3;
+}
+
+uint32_t
+cod_halfsiphash_final(const cod_halfsiphash_state *st)
+{
+  uint32_t v0 = st->v[0], v1 = st->v[1], v2 = st->v[2], v3 = st->v[3];
+  uint32_t b = ((uint32_t)st->len) << 24 | st->tail;
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v1 ^ v3;
+}
+
+/******************************************************************************
+ * Multi-lane variants
+ *
+ * Independent messages are hashed in 32-bit SIMD lanes. All lanes go through
+ * as many word-rounds as the longest message has words; lanes that have run
+ * out of words keep their state (the results are blended by a mask). Then all
+ * lanes are finalized together, so every lane computes exactly the scalar
+ * function.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define SIPHASH_X86
+#endif
+
+/* Gather `w`-th word of each message (or 0 if past the full words). */
+static inline void
+gather_words(uint32_t *out, const uint8_t *const *m, const size_t *len, int n,
+    size_t w)
+{
+  for (int i = 0; i < n; ++i)
+    out[i] = w < len[i] / 4 ? U8TO32_LE(m[i] + w * 4) : 0;
+}
+
+/* Final block: length in the top byte, followed by the trailing bytes. */
+static inline uint32_t
+tail_word(const uint8_t *m, size_t len)
+{
+  const uint8_t *t = m + (len & ~(size_t)3);
+  uint32_t b = ((uint32_t)len) << 24;
+  switch (len & 3)
+  {
+    case 3: b |= ((uint32_t)t[2]) << 16; __attribute__((fallthrough));
+    case 2: b |= ((uint32_t)t[1]) << 8; __attribute__((fallthrough));
+    case 1: b |= ((uint32_t)t[0]); break;
+  }
+  return b;
+}
+
+static inline size_t
+max_words(const size_t *len, int n)
+{
+  size_t w = 0;
+  for (int i = 0; i < n; ++i)
+    w = len[i] / 4 > w ? len[i] / 4 : w;
+  return w;
+}
+
+static void
+halfsiphash_lanes_scalar(const uint8_t key[16], const uint8_t *const *m,
+    const size_t *len, int n, uint32_t *out)
+{
+  for (int i = 0; i < n; ++i)
+    out[i] = cod_halfsiphash(key, m[i], len[i]);
+}
+
+#if defined(SIPHASH_X86)
+/* One SipRound on vectors of 32-bit lanes, given the vector operations. */
+#define VSIPROUND(ADD, XOR, OR, SHL, SHR)                 \
+  do {                                                    \
+    v0 = ADD(v0, v1); v1 = OR(SHL(v1, 5), SHR(v1, 27));   \
+    v1 = XOR(v1, v0); v0 = OR(SHL(v0, 16), SHR(v0, 16));  \
+    v2 = ADD(v2, v3); v3 = OR(SHL(v3, 8), SHR(v3, 24));   \
+    v3 = XOR(v3, v2);                                     \
+    v0 = ADD(v0, v3); v3 = OR(SHL(v3, 7), SHR(v3, 25));   \
+    v3 = XOR(v3, v0);                                     \
+    v2 = ADD(v2, v1); v1 = OR(SHL(v1, 13), SHR(v1, 19));  \
+    v1 = XOR(v1, v2); v2 = OR(SHL(v2, 16), SHR(v2, 16));  \
+  } while (0)
+#define SIPROUND_SSE2 \
+  VSIPROUND(_mm_add_epi32, _mm_xor_si128, _mm_or_si128, _mm_slli_epi32, \
+      _mm_srli_epi32)
+#define SIPROUND_AVX2 \
+  VSIPROUND(_mm256_add_epi32, _mm256_xor_si256, _mm256_or_si256, \
+      _mm256_slli_epi32, _mm256_srli_epi32)
+
+__attribute__((target("sse2")))
+static void
+halfsiphash_lanes_sse2(const uint8_t key[16], const uint8_t *const m[4],
+    const size_t len[4], uint32_t out[4])
+{
+  const __m128i k0 = _mm_set1_epi32(U8TO32_LE(key));
+  const __m128i k1 = _mm_set1_epi32(U8TO32_LE(key + 8));
+  __m128i v0 = k0;
+  __m128i v1 = k1;
+  __m128i v2 = _mm_xor_si128(_mm_set1_epi32(0x6c796765), k0);
+  __m128i v3 = _mm_xor_si128(_mm_set1_epi32(0x74656462), k1);
+  const __m128i nwords = _mm_setr_epi32(len[0] / 4, len[1] / 4, len[2] / 4,
+      len[3] / 4);
+  uint32_t words[4];
+
+  const size_t maxw = max_words(len, 4);
+  for (size_t w = 0; w < maxw; ++w)
+  {
+    gather_words(words, m, len, 4, w);
+    __m128i mi = _mm_loadu_si128((const __m128i*)words);
+    /* Lengths are below 2^31 words, so signed compare is fine. */
+    __m128i active = _mm_cmpgt_epi32(nwords, _mm_set1_epi32(w));
+    __m128i s0 = v0, s1 = v1, s2 = v2, s3 = v3;
+    v3 = _mm_xor_si128(v3, mi);
+    SIPROUND_SSE2;
+    SIPROUND_SSE2;
+    v0 = _mm_xor_si128(v0, mi);
+#define BLEND(v, s) \
+    v = _mm_or_si128(_mm_and_si128(active, v), _mm_andnot_si128(active, s))
+    BLEND(v0, s0); BLEND(v1, s1); BLEND(v2, s2); BLEND(v3, s3);
+#undef BLEND
+  }
+
+  for (int i = 0; i < 4; ++i)
+    words[i] = tail_word(m[i], len[i]);
+  __m128i b = _mm_loadu_si128((const __m128i*)words);
+  v3 = _mm_xor_si128(v3, b);
+  SIPROUND_SSE2;
+  SIPROUND_SSE2;
+  v0 = _mm_xor_si128(v0, b);
+  v2 = _mm_xor_si128(v2, _mm_set1_epi32(0xff));
+  SIPROUND_SSE2;
+  SIPROUND_SSE2;
+  SIPROUND_SSE2;
+  SIPROUND_SSE2;
+  _mm_storeu_si128((__m128i*)out, _mm_xor_si128(v1, v3));
+}
+
+__attribute__((target("avx2")))
+static void
+halfsiphash_lanes_avx2(const uint8_t key[16], const uint8_t *const m[8],
+    const size_t len[8], uint32_t out[8])
+{
+  const __m256i k0 = _mm256_set1_epi32(U8TO32_LE(key));
+  const __m256i k1 = _mm256_set1_epi32(U8TO32_LE(key + 8));
+  __m256i v0 = k0;
+  __m256i v1 = k1;
+  __m256i v2 = _mm256_xor_si256(_mm256_set1_epi32(0x6c796765), k0);
+  __m256i v3 = _mm256_xor_si256(_mm256_set1_epi32(0x74656462), k1);
+  const __m256i nwords = _mm256_setr_epi32(len[0] / 4, len[1] / 4,
+      len[2] / 4, len[3] / 4, len[4] / 4, len[5] / 4, len[6] / 4, len[7] / 4);
+  uint32_t words[8];
+
+  const size_t maxw = max_words(len, 8);
+  for (size_t w = 0; w < maxw; ++w)
+  {
+    gather_words(words, m, len, 8, w);
+    __m256i mi = _mm256_loadu_si256((const __m256i*)words);
+    __m256i active = _mm256_cmpgt_epi32(nwords, _mm256_set1_epi32(w));
+    __m256i s0 = v0, s1 = v1, s2 = v2, s3 = v3;
+    v3 = _mm256_xor_si256(v3, mi);
+    SIPROUND_AVX2;
+    SIPROUND_AVX2;
+    v0 = _mm256_xor_si256(v0, mi);
+    v0 = _mm256_blendv_epi8(s0, v0, active);
+    v1 = _mm256_blendv_epi8(s1, v1, active);
+    v2 = _mm256_blendv_epi8(s2, v2, active);
+    v3 = _mm256_blendv_epi8(s3, v3, active);
+  }
+
+  for (int i = 0; i < 8; ++i)
+    words[i] = tail_word(m[i], len[i]);
+  __m256i b = _mm256_loadu_si256((const __m256i*)words);
+  v3 = _mm256_xor_si256(v3, b);
+  SIPROUND_AVX2;
+  SIPROUND_AVX2;
+  v0 = _mm256_xor_si256(v0, b);
+  v2 = _mm256_xor_si256(v2, _mm256_set1_epi32(0xff));
+  SIPROUND_AVX2;
+  SIPROUND_AVX2;
+  SIPROUND_AVX2;
+  SIPROUND_AVX2;
+  _mm256_storeu_si256((__m256i*)out, _mm256_xor_si256(v1, v3));
+}
+#endif
+
+static int
+have_sse2(void)
+{
+#if defined(SIPHASH_X86)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+#else
+  return 0;
+#endif
+}
+
+static int
+have_avx2(void)
+{
+#if defined(SIPHASH_X86)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#else
+  return 0;
+#endif
+}
+
+void
+cod_halfsiphash_x4(const uint8_t key[16], const uint8_t *const m[4],
+    const size_t len[4], uint32_t out[4])
+{
+#if defined(SIPHASH_X86)
+  if (have_sse2())
+  {
+    halfsiphash_lanes_sse2(key, m, len, out);
+    return;
+  }
+#endif
+  halfsiphash_lanes_scalar(key, m, len, 4, out);
+}
+
+void
+cod_halfsiphash_x8(const uint8_t key[16], const uint8_t *const m[8],
+    const size_t len[8], uint32_t out[8])
+{
+#if defined(SIPHASH_X86)
+  if (have_avx2())
+  {
+    halfsiphash_lanes_avx2(key, m, len, out);
+    return;
+  }
+#endif
+  cod_halfsiphash_x4(key, m, len, out);
+  cod_halfsiphash_x4(key, m + 4, len + 4, out + 4);
+}
+
+void
+cod_halfsiphash_batch(const uint8_t key[16], const uint8_t *const *m,
+    const size_t *len, size_t n, uint32_t *out)
+{
+  size_t i = 0;
+  const int avx2 = have_avx2();
+  for (; avx2 && i + 8 <= n; i += 8)
+    cod_halfsiphash_x8(key, m + i, len + i, out + i);
+  for (; i + 4 <= n; i += 4)
+    cod_halfsiphash_x4(key, m + i, len + i, out + i);
+  halfsiphash_lanes_scalar(key, m + i, len + i, n - i, out + i);
+}
@@ -19,20 +19,35 @@
 #include <string.h>
 #include <assert.h>
 
+static char*
+copy_str(struct cod_strvec *vec, const char *str)
+{
+  size_t size = strlen(str) + 1;
+  char *copy = cod_alloc_with(vec->allocator, size);
+  memcpy(copy, str, size);
+  return copy;
+}
+
 void
 cod_strvec_init(struct cod_strvec *vec)
+{ cod_strvec_init_with_allocator(vec, NULL); }
+
+void
+cod_strvec_init_with_allocator(struct cod_strvec *vec,
+    const cod_allocator *allocator)
 {
+  vec->allocator = allocator;
   vec->cap = 0x10;
   vec->size = 0;
-  vec->data = malloc(sizeof(char*) * vec->cap);
+  vec->data = cod_alloc_with(allocator, sizeof(char*) * vec->cap);
 }
 
 void
 cod_strvec_destroy(struct cod_strvec *vec)
 {
   while (vec->size--)
-    free(vec->data[vec->size]);
-  free(vec->data);
+    cod_free_with(vec->allocator, vec->data[vec->size]);
+  cod_free_with(vec->allocator, vec->data);
 }
 
 void
@@ -40,14 +55,15 @@ cod_strvec_push(struct cod_strvec *vec, const char *str)
 {
   if (vec->size == vec->cap) {
     vec->cap <<= 1;
-    vec->data = realloc(vec->data, sizeof(char*) * vec->cap);
+    vec->data = cod_realloc_with(vec->allocator, vec->data,
+        sizeof(char*) * vec->cap);
   }
-  vec->data[vec->size++] = strdup(str);
+  vec->data[vec->size++] = copy_str(vec, str);
 }
 
 void
 cod_strvec_pop(struct cod_strvec *vec)
-{ free(vec->data[--vec->size]); }
+{ cod_free_with(vec->allocator, vec->data[--vec->size]); }
 
 void
 cod_strvec_insert(struct cod_strvec *vec, const char *str, size_t at)
@@ -57,10 +73,11 @@ cod_strvec_insert(struct cod_strvec *vec, const char *str, size_t at)
   } else {
     if (vec->size == vec->cap) {
       vec->cap <<= 1;
-      vec->data = realloc(vec->data, sizeof(char*) * vec->cap);
+      vec->data = cod_realloc_with(vec->allocator, vec->data,
+          sizeof(char*) * vec->cap);
     }
     memmove(vec->data + at + 1, vec->data + at, sizeof(char*) * (vec->size - at));
-    vec->data[at] = strdup(str);
+    vec->data[at] = copy_str(vec, str);
     vec->size += 1;
   }
 }
@@ -88,22 +105,29 @@ cod_strvec_rfind(struct cod_strvec *vec, const char *str)
 
 void
 cod_intvec_init(struct cod_intvec *vec)
+{ cod_intvec_init_with_allocator(vec, NULL); }
+
+void
+cod_intvec_init_with_allocator(struct cod_intvec *vec,
+    const cod_allocator *allocator)
 {
+  vec->allocator = allocator;
   vec->cap = 0x10;
   vec->size = 0;
-  vec->data = malloc(sizeof(intmax_t) * vec->cap);
+  vec->data = cod_alloc_with(allocator, sizeof(intmax_t) * vec->cap);
 }
 
 void
 cod_intvec_destroy(struct cod_intvec *vec)
-{ free(vec->data); }
+{ cod_free_with(vec->allocator, vec->data); }
 
 void
 cod_intvec_push(struct cod_intvec *vec, intmax_t x)
 {
   if (vec->size == vec->cap) {
     vec->cap <<= 1;
-    vec->data = realloc(vec->data, sizeof(intmax_t) * vec->cap);
+    vec->data = cod_realloc_with(vec->allocator, vec->data,
+        sizeof(intmax_t) * vec->cap);
   }
   vec->data[vec->size++] = x;
 }
@@ -123,7 +147,8 @@ cod_intvec_insert(struct cod_intvec *vec, intmax_t x, size_t at)
   } else {
     if (vec->size == vec->cap) {
       vec->cap <<= 1;
-      vec->data = realloc(vec->data, sizeof(intmax_t) * vec->cap);
+      vec->data = cod_realloc_with(vec->allocator, vec->data,
+          sizeof(intmax_t) * vec->cap);
     }
     memmove(vec->data + at + 1, vec->data + at, sizeof(intmax_t) * (vec->size - at));
     vec->data[at] = x;
@@ -154,10 +179,16 @@ cod_intvec_rfind(struct cod_intvec *vec, intmax_t x)
 
 void
 cod_ptrvec_init(struct cod_ptrvec *vec)
+{ cod_ptrvec_init_with_allocator(vec, NULL); }
+
+void
+cod_ptrvec_init_with_allocator(struct cod_ptrvec *vec,
+    const cod_allocator *allocator)
 {
+  vec->allocator = allocator;
   vec->cap = 0x10;
   vec->size = 0;
-  vec->data = malloc(sizeof(void*) * vec->cap);
+  vec->data = cod_alloc_with(allocator, sizeof(void*) * vec->cap);
 }
 
 void
@@ -167,7 +198,7 @@ cod_ptrvec_destroy(struct cod_ptrvec *vec, void (*delete)(void*))
     while (vec->size--)
       delete(vec->data[vec->size]);
   }
-  free(vec->data);
+  cod_free_with(vec->allocator, vec->data);
 }
 
 void
@@ -175,7 +206,8 @@ cod_ptrvec_push(struct cod_ptrvec *vec, void *ptr, void* (*copy)(void*))
 {
   if (vec->size == vec->cap) {
     vec->cap <<= 1;
-    vec->data = realloc(vec->data, sizeof(char*) * vec->cap);
+    vec->data = cod_realloc_with(vec->allocator, vec->data,
+        sizeof(char*) * vec->cap);
   }
   vec->data[vec->size++] = copy ? copy(ptr) : ptr;
 }
@@ -196,7 +228,8 @@ cod_ptrvec_insert(struct cod_ptrvec *vec, void *ptr, size_t at, void* (*copy)(vo
   } else {
     if (vec->size == vec->cap) {
       vec->cap <<= 1;
-      vec->data = realloc(vec->data, sizeof(void*) * vec->cap);
+      vec->data = cod_realloc_with(vec->allocator, vec->data,
+          sizeof(void*) * vec->cap);
     }
     memmove(vec->data + at + 1, vec->data + at, sizeof(void*) * (vec->size - at));
     vec->data[at] = copy ? copy(ptr) : ptr;